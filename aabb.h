@@ -70,6 +70,17 @@ class aabb {
             return y.size() > z.size() ? 1 : 2;
     }
 
+    double surface_area() const {
+        // Returns zero for an empty box.
+        if (x.size() < 0 || y.size() < 0 || z.size() < 0)
+            return 0;
+        return 2 * (x.size() * y.size() + y.size() * z.size() + z.size() * x.size());
+    }
+
+    point3 centroid() const {
+        return point3(0.5 * (x.min + x.max), 0.5 * (y.min + y.max), 0.5 * (z.min + z.max));
+    }
+
     static const aabb empty, universe;
 
   private:
@@ -4,82 +4,1078 @@
 #include "aabb.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "scheduler.h"
+#include "stats.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+enum class bvh_split {
+    sah,     // Binned surface area heuristic
+    median,  // Equal object counts either side of the centroid median on the longest axis
+    lbvh,    // Morton-code order, split on the highest differing bit: fastest build, worst tree
+    sbvh     // SAH with spatial splits that clip primitives straddling a plane into both children
+};
+
+struct bvh_build_options {
+    bvh_split split         = bvh_split::sah;
+    int       bin_count     = 16;   // SAH candidate planes per axis, plus one
+    int       max_leaf_size = 4;    // Largest number of primitives a leaf may hold
+    double    traversal_cost     = 1.0;  // SAH cost of visiting an interior node
+    double    intersection_cost  = 1.0;  // SAH cost of testing one primitive
+    int       build_threads      = 0;    // Threads building subtrees (0 = hardware concurrency)
+    double    rebuild_cost_ratio = 1.5;  // Refit SAH cost, relative to the built tree's, that makes update() rebuild
+
+    // SBVH only. Spatial splits are tried where the best object split's children overlap by
+    // more than spatial_split_alpha of the root's surface area, and stop once the clipped
+    // copies they add reach spatial_split_budget times the primitive count.
+    double    spatial_split_alpha  = 1e-5;
+    double    spatial_split_budget = 1.0;
+
+    // Saves the built tree here and maps it back in on later runs with the same primitive
+    // bounds and options, instead of building ("" disables).
+    std::string cache_path;
+};
+
+struct bvh_primitive {
+    // What the builder needs to know about one primitive. `index` refers back to the caller's
+    // own primitive storage, so the builder works for any kind of geometry.
+    aabb     bounds;
+    point3   centroid;
+    size_t   index;
+    uint32_t morton_code = 0;  // Only set for LBVH builds
+};
+
+class bvh_builder {
+  public:
+    // Chooses how to split a range of primitives. Each call reorders prims[start,end) so the
+    // two children are contiguous and returns the index where the right child begins, or
+    // `end` when the range should become a leaf. `axis` receives the axis the children were
+    // separated along, with the left child on its lower side. Binning keeps every level
+    // linear in the number of primitives, so a whole build is O(n log n) without sorting.
+
+    static size_t partition(
+        std::vector<bvh_primitive>& prims, size_t start, size_t end, const aabb& bounds,
+        const bvh_build_options& options, int& axis
+    ) {
+        axis = 0;
+        size_t count = end - start;
+        if (count <= 1)
+            return end;
+
+        if (options.split == bvh_split::lbvh)
+            return morton_partition(prims, start, end, options, axis);
+
+        // Centroid bounds are kept as raw corners: aabb pads thin boxes, which would hide
+        // ranges whose centroids coincide on an axis.
+        point3 lo = prims[start].centroid, hi = lo;
+        for (size_t i = start + 1; i < end; i++) {
+            for (int a = 0; a < 3; a++) {
+                lo[a] = std::fmin(lo[a], prims[i].centroid[a]);
+                hi[a] = std::fmax(hi[a], prims[i].centroid[a]);
+            }
+        }
+        centroid_extent extent{lo, hi};
+
+        // Coincident centroids cannot be separated by any plane.
+        axis = extent.longest_axis();
+        if (extent.size(axis) <= 0) {
+            if (count <= size_t(std::max(1, options.max_leaf_size)))
+                return end;
+            return start + count / 2;
+        }
+
+        if (options.split == bvh_split::median) {
+            if (count <= size_t(std::max(1, options.max_leaf_size)))
+                return end;
+            return median_partition(prims, start, end, axis);
+        }
+
+        return sah_partition(prims, start, end, bounds, extent, options, axis);
+    }
+
+    static void sort_by_morton_code(std::vector<bvh_primitive>& prims) {
+        // Gives every primitive the Morton code of its centroid, quantized to 10 bits per axis
+        // within the centroids' bounds, then radix sorts the primitives by code.
+        if (prims.empty())
+            return;
+
+        point3 lo = prims[0].centroid, hi = lo;
+        for (const auto& p : prims) {
+            for (int a = 0; a < 3; a++) {
+                lo[a] = std::fmin(lo[a], p.centroid[a]);
+                hi[a] = std::fmax(hi[a], p.centroid[a]);
+            }
+        }
+
+        for (auto& p : prims) {
+            uint32_t code = 0;
+            for (int a = 0; a < 3; a++) {
+                auto extent = hi[a] - lo[a];
+                auto q = extent > 0 ? (p.centroid[a] - lo[a]) / extent : 0.0;
+                auto cell = uint32_t(std::clamp(q * 1024, 0.0, 1023.0));
+                code |= spread_bits(cell) << (2 - a);
+            }
+            p.morton_code = code;
+        }
+
+        std::vector<bvh_primitive> sorted(prims.size());
+        for (int shift = 0; shift < 30; shift += 8) {
+            size_t offsets[257] = {};
+            for (const auto& p : prims)
+                offsets[((p.morton_code >> shift) & 0xff) + 1]++;
+            for (int b = 0; b < 256; b++)
+                offsets[b + 1] += offsets[b];
+            for (const auto& p : prims)
+                sorted[offsets[(p.morton_code >> shift) & 0xff]++] = p;
+            prims.swap(sorted);
+        }
+    }
+
+  private:
+    static uint32_t spread_bits(uint32_t v) {
+        // Moves the low 10 bits of v two places apart, ready to interleave with two others.
+        v = (v | (v << 16)) & 0x030000ffu;
+        v = (v | (v << 8))  & 0x0300f00fu;
+        v = (v | (v << 4))  & 0x030c30c3u;
+        v = (v | (v << 2))  & 0x09249249u;
+        return v;
+    }
+
+    static size_t morton_partition(
+        std::vector<bvh_primitive>& prims, size_t start, size_t end, const bvh_build_options& options,
+        int& axis
+    ) {
+        // The primitives are sorted by Morton code, so splitting where the highest bit that
+        // differs across the range turns on halves the range's cell in space.
+        size_t count = end - start;
+        if (count <= size_t(std::max(1, options.max_leaf_size)))
+            return end;
+
+        auto first = prims[start].morton_code, last = prims[end - 1].morton_code;
+        if (first == last)
+            return start + count / 2;
+
+        int bit = 31;
+        while (!(((first ^ last) >> bit) & 1))
+            bit--;
+        axis = 2 - bit % 3;
+
+        auto split = std::partition_point(prims.begin() + start, prims.begin() + end,
+            [bit](const bvh_primitive& p) { return !((p.morton_code >> bit) & 1); });
+        return size_t(split - prims.begin());
+    }
+
+    struct centroid_extent {
+        point3 lo, hi;
+
+        double size(int axis) const { return hi[axis] - lo[axis]; }
+
+        int longest_axis() const {
+            if (size(0) > size(1))
+                return size(0) > size(2) ? 0 : 2;
+            return size(1) > size(2) ? 1 : 2;
+        }
+    };
+
+    static size_t median_partition(std::vector<bvh_primitive>& prims, size_t start, size_t end, int axis) {
+        auto mid = start + (end - start) / 2;
+        std::nth_element(prims.begin() + start, prims.begin() + mid, prims.begin() + end,
+            [axis](const bvh_primitive& a, const bvh_primitive& b) {
+                return a.centroid[axis] < b.centroid[axis];
+            });
+        return mid;
+    }
+
+    struct bin {
+        aabb bounds = aabb::empty;
+        size_t count = 0;
+    };
+
+    static size_t sah_partition(
+        std::vector<bvh_primitive>& prims, size_t start, size_t end, const aabb& bounds,
+        const centroid_extent& extent, const bvh_build_options& options, int& axis
+    ) {
+        size_t count = end - start;
+        int bin_count = std::max(2, options.bin_count);
+
+        double best_cost = infinity;
+        int best_axis = -1, best_plane = 0;
+
+        for (int a = 0; a < 3; a++) {
+            if (extent.size(a) <= 0)
+                continue;
+
+            std::vector<bin> bins(bin_count);
+            for (size_t i = start; i < end; i++) {
+                auto& b = bins[bin_index(prims[i], a, extent, bin_count)];
+                b.bounds = aabb(b.bounds, prims[i].bounds);
+                b.count++;
+            }
+
+            // Sweep from the right to get the area and count on the far side of each plane,
+            // then from the left to price each plane.
+            std::vector<double> right_area(bin_count);
+            std::vector<size_t> right_count(bin_count);
+            aabb right_bounds = aabb::empty;
+            size_t right_total = 0;
+            for (int b = bin_count - 1; b > 0; b--) {
+                right_bounds = aabb(right_bounds, bins[b].bounds);
+                right_total += bins[b].count;
+                right_area[b] = right_bounds.surface_area();
+                right_count[b] = right_total;
+            }
+
+            aabb left_bounds = aabb::empty;
+            size_t left_total = 0;
+            for (int plane = 1; plane < bin_count; plane++) {
+                left_bounds = aabb(left_bounds, bins[plane - 1].bounds);
+                left_total += bins[plane - 1].count;
+                if (left_total == 0 || right_count[plane] == 0)
+                    continue;
+
+                double cost = left_bounds.surface_area() * left_total + right_area[plane] * right_count[plane];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = a;
+                    best_plane = plane;
+                }
+            }
+        }
+
+        auto area = bounds.surface_area();
+        double leaf_cost = options.intersection_cost * count;
+        double split_cost = options.traversal_cost
+                          + options.intersection_cost * (area > 0 ? best_cost / area : best_cost);
+
+        if (best_axis < 0 || (count <= size_t(std::max(1, options.max_leaf_size)) && leaf_cost <= split_cost)) {
+            if (count <= size_t(std::max(1, options.max_leaf_size)))
+                return end;
+            return median_partition(prims, start, end, axis);
+        }
+
+        axis = best_axis;
+        auto middle = std::partition(prims.begin() + start, prims.begin() + end,
+            [&](const bvh_primitive& p) {
+                return bin_index(p, best_axis, extent, bin_count) < best_plane;
+            });
+        return size_t(middle - prims.begin());
+    }
+
+    static int bin_index(const bvh_primitive& p, int axis, const centroid_extent& extent, int bin_count) {
+        auto b = int(bin_count * (p.centroid[axis] - extent.lo[axis]) / extent.size(axis));
+        return std::clamp(b, 0, bin_count - 1);
+    }
+};
+
+struct linear_bvh_node {
+    // One node of a flattened BVH. Nodes are stored depth-first, so an interior node's left
+    // child immediately follows it and `offset` only needs to locate the right child. Float
+    // bounds, rounded outwards, keep the node at 32 bytes: two to a cache line.
+    float    bounds_min[3];
+    float    bounds_max[3];
+    uint32_t offset;  // Leaf: index of the first primitive. Interior: index of the right child.
+    uint16_t count;   // Primitives in a leaf; 0 marks an interior node
+    uint8_t  axis;    // Interior: split axis, with the left child on its lower side
+    uint8_t  pad;
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "BVH nodes should be 32 bytes");
+
+class linear_bvh {
+  public:
+    // The builder's output in flattened form: nodes in depth-first order, and for every
+    // primitive slot the leaves refer to, the index of the caller's primitive it holds.
+
+    // Traversal keeps at most one pending node per level, so capping the depth caps the stack.
+    static const int max_depth = 64;
+
+    std::vector<linear_bvh_node> nodes;
+    std::vector<size_t> primitive_order;
+    aabb bounds = aabb::empty;
+
+    linear_bvh(std::vector<bvh_primitive> prims, const bvh_build_options& options) {
+        if (options.split == bvh_split::lbvh)
+            bvh_builder::sort_by_morton_code(prims);
+
+        if (options.split == bvh_split::sbvh) {
+            // Spatial splits add references, so leaves are gathered into a new array.
+            std::vector<bvh_primitive> placed;
+            auto budget = size_t(options.spatial_split_budget * prims.size());
+            auto root_area = aabb::empty;
+            for (const auto& p : prims)
+                root_area = aabb(root_area, p.bounds);
+            if (!prims.empty())
+                build_spatial(nodes, prims, options, 0, placed, budget, root_area.surface_area());
+            prims = std::move(placed);
+        } else if (prims.size() >= parallel_threshold) {
+            task_pool pool(options.build_threads);
+            nodes = build_parallel(pool, prims, 0, prims.size(), options, 0);
+        } else if (!prims.empty()) {
+            nodes.reserve(2 * prims.size());
+            build(nodes, prims, 0, prims.size(), options, 0);
+        }
+
+        primitive_order.reserve(prims.size());
+        for (const auto& p : prims) {
+            primitive_order.push_back(p.index);
+            bounds = aabb(bounds, p.bounds);
+        }
+    }
+
+    template <typename SlotBounds>
+    static aabb refit(linear_bvh_node* nodes, size_t node_count, const SlotBounds& slot_bounds) {
+        // Recomputes every node's bounds from slot_bounds(slot), the current bounds of the
+        // primitive in each leaf slot, and returns the root's. Children always follow their
+        // parent, so one reverse sweep visits every node after both its children.
+        auto root_bounds = aabb::empty;
+        for (size_t i = node_count; i-- > 0;) {
+            auto& node = nodes[i];
+            if (node.count > 0) {
+                auto leaf_bounds = aabb::empty;
+                for (uint32_t slot = node.offset; slot < node.offset + node.count; slot++)
+                    leaf_bounds = aabb(leaf_bounds, slot_bounds(slot));
+                root_bounds = aabb(root_bounds, leaf_bounds);
+                auto fitted = make_node(leaf_bounds);
+                std::copy_n(fitted.bounds_min, 3, node.bounds_min);
+                std::copy_n(fitted.bounds_max, 3, node.bounds_max);
+                continue;
+            }
+
+            const auto& left = nodes[i + 1];
+            const auto& right = nodes[node.offset];
+            for (int a = 0; a < 3; a++) {
+                node.bounds_min[a] = std::fmin(left.bounds_min[a], right.bounds_min[a]);
+                node.bounds_max[a] = std::fmax(left.bounds_max[a], right.bounds_max[a]);
+            }
+        }
+        return root_bounds;
+    }
+
+    static double sah_cost(const linear_bvh_node* nodes, size_t node_count, const bvh_build_options& options) {
+        // Expected cost of tracing a ray that hits the root, under the same model the SAH
+        // builder minimizes. Refitting keeps the tree's topology, so this grows as
+        // primitives drift away from the neighbours they were grouped with.
+        if (node_count == 0)
+            return 0;
+        auto root_area = surface_area(nodes[0]);
+        if (root_area <= 0)
+            return 0;
+
+        double cost = 0;
+        for (size_t i = 0; i < node_count; i++) {
+            const auto& node = nodes[i];
+            auto node_cost = node.count > 0 ? options.intersection_cost * node.count : options.traversal_cost;
+            cost += surface_area(node) * node_cost;
+        }
+        return cost / root_area;
+    }
+
+    static bool node_hit(const linear_bvh_node& node, const point3& origin, const vec3& inv_dir, interval ray_t) {
+        // Slab test, as in aabb::hit, against the node's float bounds. The far distances are
+        // pushed out by their worst-case rounding error, and a ray that only touches the box
+        // counts as entering it, so rays through a vertex or edge on the box surface (which
+        // the bounds of an exactly representable mesh often are) still reach the leaf.
+        constexpr double far_slack = 1 + 6 * std::numeric_limits<double>::epsilon();
+        for (int axis = 0; axis < 3; axis++) {
+            auto t0 = (node.bounds_min[axis] - origin[axis]) * inv_dir[axis];
+            auto t1 = (node.bounds_max[axis] - origin[axis]) * inv_dir[axis];
+            if (t0 > t1)
+                std::swap(t0, t1);
+            t1 *= far_slack;
+
+            if (t0 > ray_t.min) ray_t.min = t0;
+            if (t1 < ray_t.max) ray_t.max = t1;
+
+            if (ray_t.max < ray_t.min)
+                return false;
+        }
+        return true;
+    }
+
+    static double surface_area(const linear_bvh_node& node) {
+        double dx = node.bounds_max[0] - node.bounds_min[0];
+        double dy = node.bounds_max[1] - node.bounds_min[1];
+        double dz = node.bounds_max[2] - node.bounds_min[2];
+        return 2 * (dx * dy + dy * dz + dz * dx);
+    }
+
+    static bool valid_nodes(const linear_bvh_node* nodes, size_t node_count, size_t primitive_count) {
+        // True if nodes read from outside the process can be traversed safely: every leaf
+        // range lies within the primitives, every interior node has an axis and a right child
+        // after its left, and no path is deeper than the traversal stack. Children always
+        // follow their parent, so a node's depth is final by the time the loop reaches it.
+        std::vector<uint8_t> depth(node_count, 0);
+        for (size_t i = 0; i < node_count; i++) {
+            const auto& node = nodes[i];
+            bool valid = node.count > 0 ? size_t(node.offset) + node.count <= primitive_count
+                                        : node.offset > i + 1 && node.offset < node_count && node.axis < 3
+                                          && depth[i] + 1 < max_depth;
+            if (!valid)
+                return false;
+            if (node.count == 0) {
+                uint8_t child_depth = depth[i] + 1;
+                depth[i + 1] = std::max(depth[i + 1], child_depth);
+                depth[node.offset] = std::max(depth[node.offset], child_depth);
+            }
+        }
+        return true;
+    }
+
+    static linear_bvh_node make_node(const aabb& bounds) {
+        linear_bvh_node node{};
+        for (int a = 0; a < 3; a++) {
+            node.bounds_min[a] = round_down(bounds.axis_interval(a).min);
+            node.bounds_max[a] = round_up(bounds.axis_interval(a).max);
+        }
+        return node;
+    }
+
+  private:
+    // Ranges smaller than this are built serially by the task that reaches them.
+    static const size_t parallel_threshold = 4096;
+
+    static std::vector<linear_bvh_node> build_parallel(
+        task_pool& pool, std::vector<bvh_primitive>& prims, size_t start, size_t end,
+        const bvh_build_options& options, int depth
+    ) {
+        // Returns the subtree for prims[start,end), with interior offsets relative to its own
+        // first node. Large subtrees build their two children as separate tasks, each into its
+        // own array, and splice them together afterwards; the layout is the same as a serial
+        // build's, so the result does not depend on the thread count.
+        std::vector<linear_bvh_node> subtree;
+        if (end - start < parallel_threshold) {
+            subtree.reserve(2 * (end - start));
+            build(subtree, prims, start, end, options, depth);
+            return subtree;
+        }
+
+        size_t mid;
+        int axis;
+        subtree.push_back(split_node(prims, start, end, options, depth, mid, axis));
+        if (mid == end) {
+            subtree.back().offset = uint32_t(start);
+            subtree.back().count = uint16_t(end - start);
+            return subtree;
+        }
+
+        std::vector<linear_bvh_node> left, right;
+        task_pool::group children;
+        pool.spawn(children, [&] { left = build_parallel(pool, prims, start, mid, options, depth + 1); });
+        right = build_parallel(pool, prims, mid, end, options, depth + 1);
+        pool.wait(children);
+
+        auto left_base = uint32_t(1), right_base = uint32_t(1 + left.size());
+        subtree.back().offset = right_base;
+        subtree.back().axis = uint8_t(axis);
+        subtree.reserve(1 + left.size() + right.size());
+        for (auto node : left) {
+            if (node.count == 0)
+                node.offset += left_base;
+            subtree.push_back(node);
+        }
+        for (auto node : right) {
+            if (node.count == 0)
+                node.offset += right_base;
+            subtree.push_back(node);
+        }
+        return subtree;
+    }
+
+    static uint32_t build(
+        std::vector<linear_bvh_node>& nodes, std::vector<bvh_primitive>& prims, size_t start,
+        size_t end, const bvh_build_options& options, int depth
+    ) {
+        // Appends the subtree for prims[start,end) to `nodes` in depth-first order and returns
+        // its index.
+        auto index = uint32_t(nodes.size());
+        size_t mid;
+        int axis;
+        nodes.push_back(split_node(prims, start, end, options, depth, mid, axis));
+
+        if (mid == end) {
+            nodes[index].offset = uint32_t(start);
+            nodes[index].count = uint16_t(end - start);
+            return index;
+        }
+
+        build(nodes, prims, start, mid, options, depth + 1);
+        auto right = build(nodes, prims, mid, end, options, depth + 1);
+        nodes[index].offset = right;
+        nodes[index].axis = uint8_t(axis);
+        return index;
+    }
+
+    static uint32_t build_spatial(
+        std::vector<linear_bvh_node>& nodes, std::vector<bvh_primitive>& refs,
+        const bvh_build_options& options, int depth, std::vector<bvh_primitive>& placed,
+        size_t& budget, double root_area
+    ) {
+        // SBVH (Stich et al. 2009). Each node weighs the best object split against the best
+        // spatial split, which bins references by the slabs their bounds span rather than by
+        // centroid; a reference straddling the chosen plane is clipped to each side and goes
+        // into both children. Clipping is to the reference's bounding box, so it is exact for
+        // axis-aligned quads and conservative for everything else. Leaves append their
+        // references to `placed`; `budget` counts the copies spatial splits may still add.
+        auto index = uint32_t(nodes.size());
+        size_t mid;
+        int axis;
+        nodes.push_back(split_node(refs, 0, refs.size(), options, depth, mid, axis));
+        size_t count = refs.size();
+
+        if (mid != count && budget > 0 && !depth_capped(depth, count)) {
+            auto left_bounds = aabb::empty, right_bounds = aabb::empty;
+            for (size_t i = 0; i < mid; i++)
+                left_bounds = aabb(left_bounds, refs[i].bounds);
+            for (size_t i = mid; i < count; i++)
+                right_bounds = aabb(right_bounds, refs[i].bounds);
+
+            if (overlap_area(left_bounds, right_bounds) > options.spatial_split_alpha * root_area) {
+                double object_cost = left_bounds.surface_area() * mid + right_bounds.surface_area() * (count - mid);
+                std::vector<bvh_primitive> left, right;
+                if (spatial_split(refs, options, object_cost, budget, left, right, axis)) {
+                    std::vector<bvh_primitive>().swap(refs);
+                    build_spatial(nodes, left, options, depth + 1, placed, budget, root_area);
+                    auto right_index = build_spatial(nodes, right, options, depth + 1, placed, budget, root_area);
+                    nodes[index].offset = right_index;
+                    nodes[index].axis = uint8_t(axis);
+                    return index;
+                }
+            }
+        }
+
+        if (mid == count) {
+            nodes[index].offset = uint32_t(placed.size());
+            nodes[index].count = uint16_t(count);
+            placed.insert(placed.end(), refs.begin(), refs.end());
+            return index;
+        }
+
+        std::vector<bvh_primitive> left(refs.begin(), refs.begin() + mid), right(refs.begin() + mid, refs.end());
+        std::vector<bvh_primitive>().swap(refs);
+        build_spatial(nodes, left, options, depth + 1, placed, budget, root_area);
+        auto right_index = build_spatial(nodes, right, options, depth + 1, placed, budget, root_area);
+        nodes[index].offset = right_index;
+        nodes[index].axis = uint8_t(axis);
+        return index;
+    }
+
+    static bool spatial_split(
+        const std::vector<bvh_primitive>& refs, const bvh_build_options& options, double object_cost,
+        size_t& budget, std::vector<bvh_primitive>& left, std::vector<bvh_primitive>& right, int& axis
+    ) {
+        // Finds the cheapest spatial split of `refs` and, if it beats object_cost and fits in
+        // the budget, fills `left` and `right` with the clipped references and returns true.
+        auto node_bounds = aabb::empty;
+        for (const auto& r : refs)
+            node_bounds = aabb(node_bounds, r.bounds);
+
+        int bin_count = std::max(2, options.bin_count);
+        double best_cost = object_cost;
+        int best_axis = -1;
+        double best_position = 0;
+
+        struct spatial_bin {
+            aabb bounds = aabb::empty;
+            size_t entries = 0;  // References whose bounds start in this bin
+            size_t exits = 0;    // References whose bounds end in this bin
+        };
+
+        for (int a = 0; a < 3; a++) {
+            auto lo = node_bounds.axis_interval(a).min;
+            auto width = node_bounds.axis_interval(a).size() / bin_count;
+            if (width <= 0)
+                continue;
+
+            std::vector<spatial_bin> bins(bin_count);
+            for (const auto& r : refs) {
+                const auto& span = r.bounds.axis_interval(a);
+                int first = std::clamp(int((span.min - lo) / width), 0, bin_count - 1);
+                int last = std::clamp(int((span.max - lo) / width), first, bin_count - 1);
+                for (int b = first; b <= last; b++)
+                    bins[b].bounds = aabb(bins[b].bounds, clip(r.bounds, a, lo + b * width, lo + (b + 1) * width));
+                bins[first].entries++;
+                bins[last].exits++;
+            }
+
+            std::vector<double> right_area(bin_count);
+            std::vector<size_t> right_count(bin_count);
+            auto right_bounds = aabb::empty;
+            size_t right_total = 0;
+            for (int b = bin_count - 1; b > 0; b--) {
+                right_bounds = aabb(right_bounds, bins[b].bounds);
+                right_total += bins[b].exits;
+                right_area[b] = right_bounds.surface_area();
+                right_count[b] = right_total;
+            }
+
+            auto left_bounds = aabb::empty;
+            size_t left_total = 0;
+            for (int plane = 1; plane < bin_count; plane++) {
+                left_bounds = aabb(left_bounds, bins[plane - 1].bounds);
+                left_total += bins[plane - 1].entries;
+                auto copies = left_total + right_count[plane] - refs.size();
+                if (left_total == 0 || right_count[plane] == 0 || copies > budget)
+                    continue;
+
+                double cost = left_bounds.surface_area() * left_total + right_area[plane] * right_count[plane];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = a;
+                    best_position = lo + plane * width;
+                }
+            }
+        }
+
+        if (best_axis < 0)
+            return false;
+
+        for (const auto& r : refs) {
+            const auto& span = r.bounds.axis_interval(best_axis);
+            if (span.max <= best_position) {
+                left.push_back(r);
+            } else if (span.min >= best_position) {
+                right.push_back(r);
+            } else {
+                auto l = r, rr = r;
+                l.bounds = clip(r.bounds, best_axis, -infinity, best_position);
+                rr.bounds = clip(r.bounds, best_axis, best_position, infinity);
+                l.centroid = l.bounds.centroid();
+                rr.centroid = rr.bounds.centroid();
+                left.push_back(l);
+                right.push_back(rr);
+            }
+        }
+
+        // Bounds ending exactly on the plane were binned to its right but do not straddle it,
+        // so the split actually made can differ slightly from the one priced.
+        if (left.empty() || right.empty() || (left.size() == refs.size() && right.size() == refs.size())) {
+            left.clear();
+            right.clear();
+            return false;
+        }
+
+        budget -= std::min(budget, left.size() + right.size() - refs.size());
+        axis = best_axis;
+        return true;
+    }
+
+    static aabb clip(const aabb& box, int axis, double lo, double hi) {
+        interval spans[3] = {box.x, box.y, box.z};
+        spans[axis] = interval(std::fmax(spans[axis].min, lo), std::fmin(spans[axis].max, hi));
+        return aabb(spans[0], spans[1], spans[2]);
+    }
+
+    static double overlap_area(const aabb& a, const aabb& b) {
+        interval spans[3];
+        for (int axis = 0; axis < 3; axis++) {
+            const auto& s = a.axis_interval(axis);
+            const auto& t = b.axis_interval(axis);
+            spans[axis] = interval(std::fmax(s.min, t.min), std::fmin(s.max, t.max));
+            if (spans[axis].size() <= 0)
+                return 0;
+        }
+        return 2 * (spans[0].size() * spans[1].size() + spans[1].size() * spans[2].size()
+                  + spans[2].size() * spans[0].size());
+    }
+
+    static linear_bvh_node split_node(
+        std::vector<bvh_primitive>& prims, size_t start, size_t end, const bvh_build_options& options,
+        int depth, size_t& mid, int& axis
+    ) {
+        // Returns the node for prims[start,end) with only its bounds set, after partitioning
+        // the range. `mid` is where the right child starts, or `end` for a leaf.
+        auto node_bounds = aabb::empty;
+        for (size_t i = start; i < end; i++)
+            node_bounds = aabb(node_bounds, prims[i].bounds);
+
+        size_t count = end - start;
+        if (depth_capped(depth, count)) {
+            // With no depth to spare, the range becomes one leaf if it fits in one, and is
+            // otherwise halved by count along its longest axis, so its leaves still end within
+            // the depth the traversal stack can hold however unevenly the levels above split.
+            axis = node_bounds.longest_axis();
+            mid = end;
+            if (count > UINT16_MAX) {
+                mid = start + (count + 1) / 2;
+                std::nth_element(prims.begin() + start, prims.begin() + mid, prims.begin() + end,
+                                 [axis](const bvh_primitive& a, const bvh_primitive& b) {
+                                     return a.centroid[axis] < b.centroid[axis];
+                                 });
+            }
+            return make_node(node_bounds);
+        }
+
+        mid = bvh_builder::partition(prims, start, end, node_bounds, options, axis);
+        bool leaf = mid == end || mid == start;
+
+        if (leaf && count > UINT16_MAX) {
+            // A leaf's count is 16 bits, so bigger ranges are split at the middle instead.
+            mid = start + count / 2;
+            leaf = false;
+        }
+
+        if (leaf)
+            mid = end;
+        return make_node(node_bounds);
+    }
+
+    static bool depth_capped(int depth, size_t count) {
+        // True if a range of `count` primitives at `depth` has only the levels that halving it
+        // down to 16-bit leaves takes before reaching max_depth. Every child of a range that
+        // is not capped is no larger than it, so capped ranges are halved from then on and
+        // no leaf is deeper than max_depth - 1.
+        int levels = 0;
+        for (; count > UINT16_MAX; count = (count + 1) / 2)
+            levels++;
+        return depth + levels >= max_depth - 1;
+    }
+
+    static float round_down(double v) {
+        auto f = float(v);
+        return double(f) > v ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+    }
+
+    static float round_up(double v) {
+        auto f = float(v);
+        return double(f) < v ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+    }
+};
+
+class mapped_bvh {
+  public:
+    // A linear_bvh saved to disk and mapped back into memory. The file holds a header, the
+    // node array and the primitive order, located by byte offsets from the start of the file
+    // so it can be mapped at any address. It is mapped copy-on-write: the nodes are used in
+    // place, and refitting them only copies the pages it touches, leaving the file unchanged.
+    // Files are only valid on machines with the same byte order and node layout.
+
+    linear_bvh_node* nodes = nullptr;
+    size_t node_count = 0;
+    const uint64_t* primitive_order = nullptr;
+    size_t primitive_count = 0;
+    aabb bounds = aabb::empty;
+
+    mapped_bvh(const mapped_bvh&) = delete;
+    mapped_bvh& operator=(const mapped_bvh&) = delete;
+
+    ~mapped_bvh() {
+        if (data != MAP_FAILED)
+            munmap(data, size);
+    }
+
+    static uint64_t scene_key(const std::vector<bvh_primitive>& prims, const bvh_build_options& options) {
+        // A tree depends only on the primitives' bounds and the build options, so those are
+        // all the key needs to cover for a cached tree to be valid.
+        hasher h;
+        h.add(prims.size());
+        for (const auto& p : prims)
+            h.add(p.bounds);
+        h.add(options.split);
+        h.add(options.bin_count);
+        h.add(options.max_leaf_size);
+        h.add(options.traversal_cost);
+        h.add(options.intersection_cost);
+        h.add(options.spatial_split_alpha);
+        h.add(options.spatial_split_budget);
+        return h.value();
+    }
+
+    static bool save(const std::string& path, uint64_t key, const linear_bvh& tree) {
+        // Writes through a temporary file, as film::save does, so readers never map a
+        // half-written tree.
+        file_header header{};
+        std::memcpy(header.magic, file_magic, sizeof(file_magic));
+        header.version = file_version;
+        header.node_size = sizeof(linear_bvh_node);
+        header.key = key;
+        header.node_count = tree.nodes.size();
+        header.node_offset = round_up_to_page(sizeof(file_header));
+        header.order_count = tree.primitive_order.size();
+        header.order_offset = header.node_offset + header.node_count * sizeof(linear_bvh_node);
+        for (int a = 0; a < 3; a++) {
+            header.bounds[a] = tree.bounds.axis_interval(a).min;
+            header.bounds[3 + a] = tree.bounds.axis_interval(a).max;
+        }
+
+        auto temp_path = path + ".tmp";
+        {
+            std::ofstream out(temp_path, std::ios::binary);
+            if (!out)
+                return false;
+
+            std::vector<char> padding(header.node_offset - sizeof(file_header));
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(padding.data(), padding.size());
+            out.write(reinterpret_cast<const char*>(tree.nodes.data()), tree.nodes.size() * sizeof(linear_bvh_node));
+            for (auto index : tree.primitive_order) {
+                auto stored = uint64_t(index);
+                out.write(reinterpret_cast<const char*>(&stored), sizeof(stored));
+            }
+            if (!out)
+                return false;
+        }
+        return std::rename(temp_path.c_str(), path.c_str()) == 0;
+    }
+
+    static std::shared_ptr<mapped_bvh> load(const std::string& path, uint64_t key, size_t object_count) {
+        // Maps the tree saved at `path` for `object_count` primitives. Returns null if the file
+        // is missing, malformed, or was saved for another key.
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return nullptr;
+
+        struct stat info;
+        std::shared_ptr<mapped_bvh> tree(new mapped_bvh);
+        if (fstat(fd, &info) == 0 && size_t(info.st_size) >= sizeof(file_header)) {
+            tree->size = size_t(info.st_size);
+            tree->data = mmap(nullptr, tree->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (tree->data == MAP_FAILED)
+            return nullptr;
+
+        auto base = static_cast<char*>(tree->data);
+        file_header header;
+        std::memcpy(&header, base, sizeof(header));
+        if (std::memcmp(header.magic, file_magic, sizeof(file_magic)) != 0 || header.version != file_version
+            || header.node_size != sizeof(linear_bvh_node) || header.key != key
+            || header.node_offset % alignof(linear_bvh_node) != 0 || header.order_offset % alignof(uint64_t) != 0
+            || header.node_offset > tree->size
+            || header.node_count > (tree->size - header.node_offset) / sizeof(linear_bvh_node)
+            || header.order_offset > tree->size
+            || header.order_count > (tree->size - header.order_offset) / sizeof(uint64_t))
+            return nullptr;
+
+        tree->nodes = reinterpret_cast<linear_bvh_node*>(base + header.node_offset);
+        tree->node_count = header.node_count;
+        tree->primitive_order = reinterpret_cast<const uint64_t*>(base + header.order_offset);
+        tree->primitive_count = header.order_count;
+        tree->bounds = aabb(point3(header.bounds[0], header.bounds[1], header.bounds[2]),
+                            point3(header.bounds[3], header.bounds[4], header.bounds[5]));
+
+        // One pass over the arrays, so a damaged file is rejected rather than traversed.
+        if (!linear_bvh::valid_nodes(tree->nodes, tree->node_count, tree->primitive_count))
+            return nullptr;
+        for (size_t slot = 0; slot < tree->primitive_count; slot++) {
+            if (tree->primitive_order[slot] >= object_count)
+                return nullptr;
+        }
+        return tree;
+    }
+
+  private:
+    struct file_header {
+        char     magic[8];
+        uint32_t version;
+        uint32_t node_size;     // sizeof(linear_bvh_node) when written
+        uint64_t key;           // mapped_bvh::scene_key of the primitives the tree was built over
+        uint64_t node_count;
+        uint64_t node_offset;   // Byte offset of the node array from the start of the file
+        uint64_t order_count;
+        uint64_t order_offset;  // Byte offset of the uint64 primitive order
+        double   bounds[6];     // Root bounds: minimum x, y, z then maximum x, y, z
+    };
+
+    static constexpr char     file_magic[8] = {'R','T','B','V','H','\0','\0','\0'};
+    static constexpr uint32_t file_version = 1;
+
+    void* data = MAP_FAILED;
+    size_t size = 0;
+
+    mapped_bvh() = default;
+
+    static uint64_t round_up_to_page(uint64_t offset) {
+        const uint64_t page = 4096;
+        return (offset + page - 1) / page * page;
+    }
+};
+
+inline std::vector<bvh_primitive> bvh_primitives(const std::vector<shared_ptr<hittable>>& objects) {
+    std::vector<bvh_primitive> prims(objects.size());
+    for (size_t i = 0; i < objects.size(); i++) {
+        auto box = objects[i]->bounding_box();
+        prims[i] = {box, box.centroid(), i};
+    }
+    return prims;
+}
 
 class bvh_node : public hittable {
   public:
-    bvh_node(hittable_list list) : bvh_node(list.objects, 0, list.objects.size(), list.rng) {
+    // A BVH compiled into one contiguous node array. Leaves refer to ranges of a primitive
+    // array reordered to match, and rays walk the tree with a small explicit stack instead of
+    // a virtual call per node.
+
+    bvh_node(hittable_list list, const bvh_build_options& options = bvh_build_options())
+      : bvh_node(list.objects, options) {
         // This constructor is used to create a BVH node from a hittable_list.
         // It takes the list of objects and constructs the BVH tree from them.
-        // The list's random number generator is used for randomness in axis selection.
       // some weird black magic fuckery goes on here to do with scopes.
-      // cba to figure it out beyond bvh node only exists as 
+      // cba to figure it out beyond bvh node only exists as
       // long as we need it - after that 🤓
     }
 
-    bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end, std::mt19937& rng) {
-        bbox = aabb::empty;
-        for (size_t object_index=start; object_index < end; object_index++)
-            bbox = aabb(bbox, objects[object_index]->bounding_box());
+    bvh_node(const std::vector<shared_ptr<hittable>>& objects, const bvh_build_options& options)
+      : source_objects(objects), options(options) {
+        build(source_objects, true);
+    }
+
+    bool update() {
+        // Brings the tree up to date after primitives have moved. It must not run while rays
+        // are being traced, so call it between frames. The node bounds are refitted in place,
+        // unless that leaves the tree options.rebuild_cost_ratio times costlier to trace than
+        // when it was built, in which case it is rebuilt. Returns true if it rebuilt.
+        bbox = linear_bvh::refit(nodes, node_count, [this](uint32_t slot) { return primitives[slot]->bounding_box(); });
+        if (linear_bvh::sah_cost(nodes, node_count, options) <= options.rebuild_cost_ratio * build_cost)
+            return false;
 
-        int axis = bbox.longest_axis();
+        // The moved scene no longer matches any cache file, so this build is not saved.
+        build(source_objects, false);
+        return true;
+    }
 
-        auto comparator = (axis == 0) ? box_x_compare
-                        : (axis == 1) ? box_y_compare
-                                      : box_z_compare;
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (node_count == 0)
+            return false;
 
-        size_t object_span = end - start;
+        const point3& origin = r.origin();
+        const vec3& direction = r.direction();
+        vec3 inv_dir(1.0 / direction.x(), 1.0 / direction.y(), 1.0 / direction.z());
+        bool dir_is_neg[3] = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
 
-        if (object_span == 1) {
-            left = right = objects[start];
-        } else if (object_span == 2) {
-            left = objects[start];
-            right = objects[start+1];
-        } else {
-            std::sort(std::begin(objects) + start, std::begin(objects) + end, comparator);
+        bool hit_anything = false;
+        uint32_t stack[linear_bvh::max_depth];
+        int stack_size = 0;
+        uint32_t current = 0;
 
-            auto mid = start + object_span/2;
-            left = make_shared<bvh_node>(objects, start, mid, rng);
-            right = make_shared<bvh_node>(objects, mid, end, rng);
+        while (true) {
+            const auto& node = nodes[current];
+            trace_stats::node_visit(1);
+            if (linear_bvh::node_hit(node, origin, inv_dir, ray_t)) {
+                if (node.count > 0) {
+                    trace_stats::primitive_tests(node.count);
+                    for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                        if (primitives[i]->hit(r, ray_t, rec)) {
+                            hit_anything = true;
+                            ray_t.max = rec.t;
+                        }
+                    }
+                    if (stack_size == 0)
+                        break;
+                    current = stack[--stack_size];
+                } else if (dir_is_neg[node.axis]) {
+                    // Heading down the split axis: the right child is nearer.
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+            } else {
+                if (stack_size == 0)
+                    break;
+                current = stack[--stack_size];
+            }
         }
+
+        return hit_anything;
     }
 
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        if (!bbox.hit(r, ray_t))
+    bool occluded(const ray& r, interval ray_t) const override {
+        // The same walk as hit(), ending at the first primitive that blocks the ray. ray_t never
+        // shrinks, so the near-first order only helps find a blocker sooner.
+        if (node_count == 0)
             return false;
 
-        bool hit_left = left->hit(r, ray_t, rec);
-        bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+        const point3& origin = r.origin();
+        const vec3& direction = r.direction();
+        vec3 inv_dir(1.0 / direction.x(), 1.0 / direction.y(), 1.0 / direction.z());
+        bool dir_is_neg[3] = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
+
+        uint32_t stack[linear_bvh::max_depth];
+        int stack_size = 0;
+        uint32_t current = 0;
+
+        while (true) {
+            const auto& node = nodes[current];
+            trace_stats::node_visit(1);
+            if (linear_bvh::node_hit(node, origin, inv_dir, ray_t)) {
+                if (node.count > 0) {
+                    for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                        trace_stats::primitive_tests(1);
+                        if (primitives[i]->occluded(r, ray_t))
+                            return true;
+                    }
+                    if (stack_size == 0)
+                        break;
+                    current = stack[--stack_size];
+                } else if (dir_is_neg[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+            } else {
+                if (stack_size == 0)
+                    break;
+                current = stack[--stack_size];
+            }
+        }
 
-        return hit_left || hit_right;
+        return false;
     }
 
     aabb bounding_box() const override { return bbox; }
 
   private:
-    shared_ptr<hittable> left;
-    shared_ptr<hittable> right;
+    friend class compiled_scene;
+    linear_bvh_node* nodes = nullptr;  // Either built_nodes or the nodes of the cache mapping
+    size_t node_count = 0;
+    std::vector<linear_bvh_node> built_nodes;
+    std::shared_ptr<mapped_bvh> cache;
+    std::vector<shared_ptr<hittable>> primitives;
+    std::vector<shared_ptr<hittable>> source_objects;  // As given; SBVH leaves repeat some in primitives
     aabb bbox;
+    bvh_build_options options;
+    double build_cost = 0;  // SAH cost when last built, for update()'s rebuild test
 
-    static bool box_compare(
-        const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index
-    ) {
-        auto a_axis_interval = a->bounding_box().axis_interval(axis_index);
-        auto b_axis_interval = b->bounding_box().axis_interval(axis_index);
-        return a_axis_interval.min < b_axis_interval.min;
-    }
+    void build(const std::vector<shared_ptr<hittable>>& objects, bool use_cache) {
+        auto prims = bvh_primitives(objects);
+        use_cache = use_cache && !options.cache_path.empty();
+        auto key = use_cache ? mapped_bvh::scene_key(prims, options) : 0;
 
-    static bool box_x_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-        return box_compare(a, b, 0);
-    }
+        built_nodes.clear();
+        cache = use_cache ? mapped_bvh::load(options.cache_path, key, objects.size()) : nullptr;
+        primitives.clear();
 
-    static bool box_y_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-        return box_compare(a, b, 1);
-    }
+        if (cache) {
+            nodes = cache->nodes;
+            node_count = cache->node_count;
+            bbox = cache->bounds;
+            primitives.reserve(cache->primitive_count);
+            for (size_t slot = 0; slot < cache->primitive_count; slot++)
+                primitives.push_back(objects[cache->primitive_order[slot]]);
+        } else {
+            linear_bvh tree(std::move(prims), options);
+            if (use_cache && !mapped_bvh::save(options.cache_path, key, tree))
+                std::clog << "Failed to write BVH cache " << options.cache_path << ".\n";
 
-    static bool box_z_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-        return box_compare(a, b, 2);
+            built_nodes = std::move(tree.nodes);
+            nodes = built_nodes.data();
+            node_count = built_nodes.size();
+            bbox = tree.bounds;
+            primitives.reserve(tree.primitive_order.size());
+            for (auto index : tree.primitive_order)
+                primitives.push_back(objects[index]);
+        }
+        build_cost = linear_bvh::sah_cost(nodes, node_count, options);
     }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -1,13 +1,35 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include "cluster.h"
+#include "compiled_scene.h"
+#include "denoiser.h"
+#include "film.h"
 #include "hittable.h"
+#include "image_writer.h"
 #include "material.h"
+#include "sampler.h"
+#include "scheduler.h"
+#include "stats.h"
 #include <thread>
 #include <vector>
 #include <mutex>
 #include <atomic>
+#include <chrono>
+#include <fstream>
 #include <random>
+#include <string>
+
+enum class integrator {
+    iterative,  // Loop over bounces with Russian roulette termination
+    recursive   // Reference: one recursive call per bounce, no roulette
+};
+
+enum class render_status {
+    rendered,  // The image was written to the output stream
+    served,    // As a cluster worker, rendered tiles for a coordinator and wrote nothing
+    skipped    // As a cluster worker, found no coordinator that accepted it
+};
 
 class camera {
   public:
@@ -17,6 +39,10 @@ class camera {
     int    max_depth         = 10;   // Maximum number of ray bounces into scene
     colour  background;              // Scene background color
 
+    integrator path_integrator = integrator::iterative;  // How each camera ray is traced
+    sampler_type sampling = sampler_type::sobol;         // How sample points are generated
+    int    roulette_depth = 5;       // Bounces before Russian roulette may end a path
+
     double vfov = 90;                  // Vertical view angle (field of view)
     point3 lookfrom = point3(0,0,0);   // Point camera is looking from
     point3 lookat   = point3(0,0,-1);  // Point camera is looking at
@@ -25,57 +51,183 @@ class camera {
     double defocus_angle = 0;  // Variation angle of rays through each pixel
     double focus_dist = 10;    // Distance from camera lookfrom point to plane of perfect focus
 
+    int    tile_size    = 16;  // Edge length in pixels of the square tiles handed to workers
+    int    thread_count = 0;   // Worker threads used to render (0 = hardware concurrency)
+
+    bool   compile_scene = false;  // Trace a compiled_scene flattened from the world, not the graph itself
+
+    bool   adaptive_sampling     = false;  // Stop sampling a pixel once its noise is low enough
+    int    min_samples_per_pixel = 16;     // Adaptive lower bound (samples_per_pixel is the upper)
+    double noise_threshold       = 0.01;   // Adaptive target relative error of pixel luminance
+
+    double time_budget      = 0;  // Wall-clock seconds to render for (0 = no limit)
+    int    samples_per_pass = 0;  // Samples per pixel added by each progressive pass (0 = automatic)
+
+    bool   denoise            = false;  // Filter the final image, guided by first-hit feature buffers
+    int    denoise_iterations = 5;      // Denoiser passes; each doubles the filter footprint
+    double denoise_strength   = 4;      // Colour difference the filter smooths over, in standard errors
+
+    image_format output_format = image_format::ppm_binary;  // Encoding of the image written to `out`
+    std::string hdr_output_path;         // Also write linear radiance here as PFM ("" disables)
+    std::string cost_heatmap_path;       // With RT_STATS, write per-pixel traversal cost here ("" disables)
+
+    std::string checkpoint_path;         // Accumulation checkpoint file ("" disables checkpoints)
+    int    checkpoint_interval = 300;    // Seconds between checkpoint writes
+    std::string scene_tag;               // Names the scene in checkpoints; change it with the scene
 
-    void render(const hittable& world, unsigned int seed, std::ostream& out) {
+    render_status render(const hittable& scene, unsigned int seed, std::ostream& out) {
+        // Renders in progressive passes over the whole image until every pixel has
+        // samples_per_pixel samples (or has converged, in adaptive mode) or the time budget runs
+        // out. If checkpoint_path names a checkpoint written for the same scene, camera and
+        // seed, rendering resumes from it; raise samples_per_pixel to add more samples to a
+        // finished render.
         initialize();
 
-        std::vector<std::vector<colour>> framebuffer(image_height, std::vector<colour>(image_width));
-        int thread_count = std::thread::hardware_concurrency();
-        if (thread_count == 0) thread_count = 4; 
-
-        std::atomic<int> lines_done{0};
-
-        auto render_scanlines = [&](int start, int end, int thread_id) {
-            std::mt19937 rng(seed + thread_id); // Unique generator per thread
-            for (int j = start; j < end; ++j) {
-                for (int i = 0; i < image_width; ++i) {
-                    colour pixel_color(0,0,0);
-                    for (int sample = 0; sample < samples_per_pixel; ++sample) {
-                        ray r = get_ray(i, j, rng);
-                        pixel_color += ray_colour(r, max_depth, world, rng);
-                    }
-                    framebuffer[j][i] = pixel_samples_scale * pixel_color;
-                }
-                int done = ++lines_done;
-                if (done % 10 == 0 || done == image_height) {
-                    std::clog << "\rScanlines remaining: " << (image_height - done) << "   " << std::flush;
+        // The world is compiled on its first render and kept; later renders of the same world
+        // only update() it, so moved geometry is picked up without compiling again. A different
+        // world, or one with objects added or removed, is compiled afresh.
+        if (compile_scene && (!compiled || !compiled->compiled_from(scene)))
+            compiled = std::make_unique<compiled_scene>(scene);
+        else if (compile_scene)
+            compiled->update();
+        const hittable& world = compile_scene ? *compiled : scene;
+
+        using clock = std::chrono::steady_clock;
+        auto deadline = clock::time_point::max();
+        if (time_budget > 0)
+            deadline = clock::now() + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(time_budget));
+
+        film image(image_width, image_height, denoise);
+        auto key = checkpoint_key(scene, seed);
+        if (!checkpoint_path.empty() && image.load(checkpoint_path, key)) {
+            std::clog << "Resuming from " << checkpoint_path << " with "
+                      << image.average_samples() << " samples per pixel.\n";
+        }
+
+        tile_scheduler scheduler(image_width, image_height, tile_size);
+        int tile_total = int(scheduler.tiles().size());
+
+        // Traversal work per pixel and in total, only gathered in RT_STATS builds.
+        std::vector<uint64_t> pixel_costs(trace_stats::enabled ? size_t(image_width) * image_height : 0);
+        uint64_t* pixel_cost_data = pixel_costs.empty() ? nullptr : pixel_costs.data();
+        trace_counters stats_total;
+        std::mutex stats_mutex;
+        int workers = cluster_config.threads > 0 ? cluster_config.threads : thread_count;
+
+        if (cluster_config.role == cluster_role::worker) {
+            // A worker renders whatever tiles the coordinator sends and produces no output of
+            // its own. Callers should stop once a worker has served a render, so the rest of the
+            // program (output files, follow-up commands) only runs in the coordinator.
+            auto render_region = [&](film& part, const tile& t, int target) {
+                render_tile_pixels(part, t, target, clock::time_point::max(), world, seed, nullptr);
+            };
+            if (serve_cluster_tiles(job_key(scene, seed), workers, render_region))
+                return render_status::served;
+            std::clog << "No coordinator accepted this worker for the render; skipping it.\n";
+            return render_status::skipped;
+        }
+
+        std::atomic<int> tiles_done{0};
+        int pass_target = 0;
+        std::mutex image_mutex;  // Guards tile stores against checkpoint writes
+        std::mutex checkpoint_mutex;
+        auto last_checkpoint = clock::now();
+
+        auto fetch_tile = [&](const tile& t) {
+            std::lock_guard<std::mutex> lock(image_mutex);
+            return image.region(t.x0, t.y0, t.x1, t.y1);
+        };
+
+        auto commit_tile = [&](const tile& t, const film& part) {
+            {
+                std::lock_guard<std::mutex> lock(image_mutex);
+                image.store_region(part, t.x0, t.y0);
+            }
+
+            int done = ++tiles_done;
+            if (done % 16 == 0 || done == tile_total) {
+                std::clog << "\rSamples per pixel: " << pass_target << ", tiles remaining: "
+                          << (tile_total - done) << "   " << std::flush;
+            }
+
+            if (!checkpoint_path.empty() && checkpoint_mutex.try_lock()) {
+                auto now = clock::now();
+                if (now - last_checkpoint >= std::chrono::seconds(checkpoint_interval)) {
+                    std::lock_guard<std::mutex> lock(image_mutex);
+                    write_checkpoint(image, key);
+                    last_checkpoint = now;
                 }
+                checkpoint_mutex.unlock();
             }
         };
 
-        std::vector<std::thread> threads;
-        int lines_per_thread = image_height / thread_count;
-        int extra = image_height % thread_count;
-        int start = 0;
-        for (int t = 0; t < thread_count; ++t) {
-            int end = start + lines_per_thread + (t < extra ? 1 : 0);
-            threads.emplace_back(render_scanlines, start, end, t);
-            start = end;
-        }
-        for (auto& th : threads) th.join();
-
-        out << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-        for (int j = 0; j < image_height; ++j) {
-            for (int i = 0; i < image_width; ++i) {
-                write_colour(out, framebuffer[j][i]);
+        auto render_tile = [&](const tile& t, int /*worker_id*/) {
+            // Tiles render into a private copy of their pixels and store it back when done, so
+            // a checkpoint only ever sees whole tiles. Once the deadline has passed, tiles that
+            // have not started yet are skipped.
+            if (clock::now() >= deadline)
+                return;
+            film part = fetch_tile(t);
+            auto stats_before = trace_stats::local();
+            render_tile_pixels(part, t, pass_target, deadline, world, seed, pixel_cost_data);
+            if constexpr (trace_stats::enabled) {
+                std::lock_guard<std::mutex> lock(stats_mutex);
+                stats_total += trace_stats::local() - stats_before;
             }
+            commit_tile(t, part);
+        };
+
+        cluster_coordinator coordinator(job_key(scene, seed), scheduler.tiles(), fetch_tile, commit_tile, render_tile);
+        bool distributed = cluster_config.role == cluster_role::coordinator && coordinator.start(workers);
+
+        for (int pass = 0; pass_target < samples_per_pixel && clock::now() < deadline; pass++) {
+            pass_target = std::min(samples_per_pixel, pass_target + pass_samples(pass));
+            tiles_done = 0;
+
+            // Workers are not given the deadline, so in cluster mode the time budget is only
+            // checked between passes.
+            if (distributed)
+                coordinator.run_pass(pass_target, workers);
+            else
+                scheduler.run(workers, render_tile);
+        }
+        coordinator.finish();
+
+        if (clock::now() >= deadline)
+            std::clog << "\nTime budget of " << time_budget << "s reached.";
+
+        if (!checkpoint_path.empty())
+            write_checkpoint(image, key);
+
+        std::vector<float> pixels;
+        if (denoise) {
+            denoiser filter;
+            filter.iterations = denoise_iterations;
+            filter.colour_sigma = denoise_strength;
+            pixels = filter.filter(image, workers, tile_size);
+        } else {
+            pixels = image.mean_rgb();
+        }
+        write_image(out, output_format, image_width, image_height, pixels);
+        if (!hdr_output_path.empty()) {
+            std::ofstream hdr(hdr_output_path, std::ios::binary);
+            write_image(hdr, image_format::pfm, image_width, image_height, pixels);
         }
-        std::clog << "\rDone.                 \n";
+        std::clog << "\rDone. Average samples per pixel: " << image.average_samples() << "\n";
+
+        if constexpr (trace_stats::enabled)
+            report_stats(stats_total);
+        if (!cost_heatmap_path.empty()) {
+            if (trace_stats::enabled)
+                write_cost_heatmap(pixel_costs);
+            else
+                std::clog << "Skipping the cost heatmap: this build was made without RT_STATS.\n";
+        }
+        return render_status::rendered;
     }
 
   private:
     int    image_height;         // Rendered image height
-    double pixel_samples_scale;  // Color scale factor for a sum of pixel samples
     point3 center;               // Camera center
     point3 pixel00_loc;          // Location of pixel 0, 0
     vec3   pixel_delta_u;        // Offset to pixel to the right
@@ -83,12 +235,12 @@ class camera {
     vec3   u, v, w;              // Camera frame basis vectors
     vec3   defocus_disk_u;       // Defocus disk horizontal radius
     vec3   defocus_disk_v;       // Defocus disk vertical radius
+    std::unique_ptr<compiled_scene> compiled;  // The last world rendered, if compile_scene is set
 
     void initialize() {
         image_height = int(image_width / aspect_ratio);
         image_height = (image_height < 1) ? 1 : image_height;
 
-        pixel_samples_scale = 1.0 / samples_per_pixel;
         center = lookfrom;
 
         // Determine viewport dimensions.
@@ -121,46 +273,303 @@ class camera {
         defocus_disk_v = v * defocus_radius;
     }
 
-    ray get_ray(int i, int j, std::mt19937& rng) const {
-        auto offset = sample_square(rng);
+    int pass_samples(int pass) const {
+        // Samples added to each pixel in a progressive pass. Under a time budget the passes
+        // start at one sample and double, so a usable image exists as early as possible.
+        if (samples_per_pass > 0)
+            return samples_per_pass;
+        if (time_budget > 0)
+            return std::min(1 << std::min(pass, 4), 16);
+        return samples_per_pixel;
+    }
+
+    void render_tile_pixels(
+        film& part, const tile& t, int target, std::chrono::steady_clock::time_point deadline,
+        const hittable& world, unsigned int seed, uint64_t* pixel_costs
+    ) const {
+        // Brings every pixel of `part`, which covers tile `t`, up to `target` samples, stopping
+        // early at the deadline. If `pixel_costs` is given, each pixel's traversal cost is added
+        // to its entry in that full-image, row-major array.
+        target = std::min(target, samples_per_pixel);
+        std::vector<std::pair<int, int>> deferred;
+
+        for (int j = 0; j < part.height(); ++j) {
+            for (int i = 0; i < part.width(); ++i) {
+                if (std::chrono::steady_clock::now() >= deadline)
+                    return;
+                if (!sample_pixel(part, t, i, j, target, world, seed, pixel_costs))
+                    deferred.emplace_back(i, j);
+            }
+        }
+
+        // Pixels whose samples needed geometry that was not in memory are retried once the
+        // rest of the tile is done, which gives the geometry time to page it in. After a few
+        // rounds the retries are made blocking, so the tile always completes.
+        const int rounds_before_blocking = 8;
+        for (int round = 1; !deferred.empty(); round++) {
+            if (std::chrono::steady_clock::now() >= deadline)
+                break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            ray_deferral::blocking() = round > rounds_before_blocking;
+
+            auto retry = std::move(deferred);
+            deferred.clear();
+            for (auto [i, j] : retry) {
+                if (!sample_pixel(part, t, i, j, target, world, seed, pixel_costs))
+                    deferred.emplace_back(i, j);
+            }
+        }
+        ray_deferral::blocking() = false;
+    }
+
+    bool sample_pixel(
+        film& part, const tile& t, int i, int j, int target, const hittable& world, unsigned int seed,
+        uint64_t* pixel_costs
+    ) const {
+        // Adds samples to pixel (i, j) of `part` until it has `target` or has converged.
+        // Returns false if it stopped early because a sample was deferred.
+        auto cost_before = pixel_costs ? trace_stats::local().cost() : 0;
+        bool complete = true;
+
+        while (part.sample_count(i, j) < target) {
+            if (adaptive_sampling && pixel_converged(part, i, j))
+                break;
+
+            // Every sample draws from its own stream keyed by pixel and sample index, so
+            // the image is the same whatever tile size, thread count, resume point or
+            // cluster layout produced it.
+            int x = t.x0 + i, y = t.y0 + j;
+            sampler smp(sampling, seed, x, y, part.sample_count(i, j), samples_per_pixel);
+            trace_stats::camera_ray();
+            ray r = get_ray(x, y, smp);
+
+            ray_deferral::pending() = false;
+            surface_features features;
+            auto radiance = sample_radiance(r, world, smp, denoise ? &features : nullptr);
+            if (ray_deferral::pending()) {
+                complete = false;
+                break;
+            }
+
+            part.add_sample(i, j, radiance);
+            if (denoise)
+                part.add_features(i, j, features);
+        }
+
+        if (pixel_costs)
+            pixel_costs[size_t(t.y0 + j) * image_width + t.x0 + i] += trace_stats::local().cost() - cost_before;
+        return complete;
+    }
+
+    uint64_t job_key(const hittable& world, unsigned int seed) const {
+        // Cluster workers must agree with the coordinator on everything that affects a tile's
+        // samples, including the settings a checkpoint is allowed to change.
+        hasher h;
+        h.add(checkpoint_key(world, seed));
+        h.add(samples_per_pixel);
+        h.add(adaptive_sampling);
+        h.add(min_samples_per_pixel);
+        h.add(noise_threshold);
+        h.add(path_integrator);
+        h.add(roulette_depth);
+        h.add(sampling);
+        h.add(denoise);
+        return h.value();
+    }
+
+    uint64_t checkpoint_key(const hittable& world, unsigned int seed) const {
+        // Fingerprint of everything that changes what a pixel's samples converge to. The sample
+        // budget, adaptive settings and threading are left out so they can change on resume.
+        hasher h;
+        h.add(image_width);
+        h.add(image_height);
+        h.add(max_depth);
+        h.add(background);
+        h.add(vfov);
+        h.add(lookfrom);
+        h.add(lookat);
+        h.add(vup);
+        h.add(defocus_angle);
+        h.add(focus_dist);
+        h.add(seed);
+        h.add(world.bounding_box());
+        h.add(scene_tag);
+        return h.value();
+    }
+
+    void report_stats(const trace_counters& total) const {
+        auto rays = double(std::max<uint64_t>(total.camera_rays, 1));
+        std::clog << "Camera rays: " << total.camera_rays
+                  << ", per ray: " << total.bounces / rays << " bounces, "
+                  << total.node_visits / rays << " node visits, "
+                  << total.box_tests / rays << " box tests, "
+                  << total.primitive_tests / rays << " primitive tests\n";
+    }
+
+    void write_cost_heatmap(const std::vector<uint64_t>& costs) const {
+        // Shades each pixel by its traversal cost from black through red and yellow to white,
+        // with the 99th percentile at full heat so a few pathological pixels do not wash out
+        // the rest. Tiles rendered by cluster workers are not counted here.
+        std::vector<uint64_t> sorted(costs);
+        auto p99 = sorted.begin() + std::ptrdiff_t(0.99 * (sorted.size() - 1));
+        std::nth_element(sorted.begin(), p99, sorted.end());
+        auto scale = double(std::max<uint64_t>(*p99, 1));
+
+        std::vector<float> rgb(costs.size() * 3);
+        for (size_t index = 0; index < costs.size(); index++) {
+            auto heat = std::fmin(costs[index] / scale, 1.0);
+            for (int c = 0; c < 3; c++) {
+                // write_image gamma-encodes its input, so the ramp is squared to undo that.
+                auto v = std::clamp(3 * heat - c, 0.0, 1.0);
+                rgb[3*index + c] = float(v * v);
+            }
+        }
+
+        std::ofstream heatmap(cost_heatmap_path, std::ios::binary);
+        write_image(heatmap, output_format, image_width, image_height, rgb);
+    }
+
+    void write_checkpoint(const film& image, uint64_t key) const {
+        if (!image.save(checkpoint_path, key))
+            std::cerr << "\nFailed to write checkpoint " << checkpoint_path << ".\n";
+    }
+
+    bool pixel_converged(const film& image, int i, int j) const {
+        // Only test convergence every few samples once past the lower bound; stopping on the
+        // first lucky sample after each one biases dark pixels towards black.
+        const int check_interval = 8;
+        int min_samples = std::max(2, std::min(min_samples_per_pixel, samples_per_pixel));
+        int n = image.sample_count(i, j);
+        if (n < min_samples || (n - min_samples) % check_interval != 0)
+            return false;
+        return image.converged(i, j, noise_threshold);
+    }
+
+    colour sample_radiance(const ray& r, const hittable& world, sampler& smp, surface_features* features) const {
+        // Traces one camera ray. If `features` is given, it receives what the ray hit first.
+        auto radiance = path_integrator == integrator::recursive
+                      ? ray_colour_recursive(r, max_depth, world, smp, features)
+                      : ray_colour(r, world, smp, features);
+        path_sample::free_flight() = -1;
+        return radiance;
+    }
+
+    void record_features(const ray& r, const hit_record* rec, surface_features* features) const {
+        // Fills in the first-hit features for a camera ray; rec is null if the ray escaped.
+        if (!features)
+            return;
+        if (!rec) {
+            *features = {background, vec3(0,0,0), surface_features::miss_depth};
+            return;
+        }
+        *features = {material_table::get(rec->mat).base_colour(*rec), rec->normal, rec->t * r.direction().length()};
+    }
+
+    ray get_ray(int i, int j, sampler& smp) const {
+        auto offset = sample_square(smp);
         auto pixel_sample = pixel00_loc
                           + ((i + offset.x()) * pixel_delta_u)
                           + ((j + offset.y()) * pixel_delta_v);
 
-        auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample(rng);
+        // The lens sample is drawn even without defocus so the time keeps its dimension.
+        auto lens_sample = defocus_disk_sample(smp);
+        auto ray_origin = (defocus_angle <= 0) ? center : lens_sample;
         auto ray_direction = pixel_sample - ray_origin;
-        auto ray_time = random_double(rng) * 0.5;
+        auto ray_time = smp.get_1d() * 0.5;
 
         return ray(ray_origin, ray_direction, ray_time);
     }
 
-    vec3 sample_square(std::mt19937& rng) const {
-        return vec3(random_double(rng) - 0.5, random_double(rng) - 0.5, 0);
+    vec3 sample_square(sampler& smp) const {
+        return smp.get_2d() - vec3(0.5, 0.5, 0);
     }
 
-    point3 defocus_disk_sample(std::mt19937& rng) const {
-        auto p = random_in_unit_disk(rng);
+    point3 defocus_disk_sample(sampler& smp) const {
+        auto p = sample_concentric_disk(smp.get_2d());
         return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
     }
 
-    colour ray_colour(const ray& r, int depth, const hittable& world, std::mt19937& rng) const {
+    colour ray_colour(const ray& r, const hittable& world, sampler& smp, surface_features* features) const {
+        // Iterative path tracer. The path carries its throughput, the product of the
+        // attenuations so far, instead of recursing once per bounce. After roulette_depth
+        // bounces, paths survive with probability tied to their throughput and are reweighted
+        // when they do, which ends near-black paths early without biasing the estimate.
+        colour radiance(0,0,0);
+        colour throughput(1,1,1);
+        ray current = r;
+
+        for (int depth = 0; depth < max_depth; depth++) {
+            smp.start_bounce(depth);
+            path_sample::free_flight() = smp.free_flight();
+
+            hit_record rec;
+            if (!world.hit(current, interval(0.001, infinity), rec)) {
+                if (depth == 0)
+                    record_features(current, nullptr, features);
+                radiance += throughput * background;
+                break;
+            }
+
+            if (depth == 0)
+                record_features(current, &rec, features);
+
+            const auto& mat = material_table::get(rec.mat);
+            radiance += throughput * mat.emitted(rec.u, rec.v, rec.p);
+
+            ray scattered;
+            colour attenuation;
+            if (!mat.scatter(current, rec, attenuation, scattered, smp))
+                break;
+            trace_stats::bounce();
+
+            throughput = throughput * attenuation;
+
+            if (depth + 1 >= roulette_depth) {
+                auto survival = std::fmin(std::fmax(throughput.x(), std::fmax(throughput.y(), throughput.z())), 0.95);
+                if (smp.get_1d() >= survival)
+                    break;
+                throughput /= survival;
+            }
+
+            current = scattered;
+        }
+
+        return radiance;
+    }
+
+    colour ray_colour_recursive(
+        const ray& r, int depth, const hittable& world, sampler& smp, surface_features* features
+    ) const {
+        // Reference integrator: one recursive call per bounce and no Russian roulette. Only the
+        // outermost call is given `features`.
+
         // If we've exceeded the ray bounce limit, no more light is gathered.
         if (depth <= 0)
             return colour(0,0,0);
 
+        // As in ray_colour, the bounce's dimensions (media's free flight among them) are
+        // chosen before the ray is traced.
+        smp.start_bounce(max_depth - depth);
+        path_sample::free_flight() = smp.free_flight();
+
         hit_record rec;
         // If the ray hits nothing, return the background color.
-        if (!world.hit(r, interval(0.001, infinity), rec))
+        if (!world.hit(r, interval(0.001, infinity), rec)) {
+            record_features(r, nullptr, features);
             return background;
+        }
+        record_features(r, &rec, features);
 
         ray scattered;
         colour attenuation;
-        colour color_from_emission = rec.mat->emitted(rec.u, rec.v, rec.p);
+        const auto& mat = material_table::get(rec.mat);
+        colour color_from_emission = mat.emitted(rec.u, rec.v, rec.p);
 
-        if (!rec.mat->scatter(r, rec, attenuation, scattered, rng))
+        if (!mat.scatter(r, rec, attenuation, scattered, smp))
             return color_from_emission;
+        trace_stats::bounce();
 
-        colour color_from_scatter = attenuation * ray_colour(scattered, depth-1, world, rng);
+        colour color_from_scatter = attenuation * ray_colour_recursive(scattered, depth-1, world, smp, nullptr);
 
         return color_from_emission + color_from_scatter;
     }
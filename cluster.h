@@ -0,0 +1,500 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+// Distributed tile rendering. A coordinator process listens on a TCP socket, optionally spawns
+// local worker processes (copies of this executable started with --worker), and hands each
+// connected worker one tile at a time. Workers send back the tile's accumulation buffers, which
+// the coordinator stores in the tile's own slot, so the merged image does not depend on which
+// worker rendered what. A worker that disconnects mid-tile has its tile re-issued.
+
+#include "film.h"
+#include "scheduler.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class cluster_role {
+    standalone,   // Render everything in this process
+    coordinator,  // Hand tiles to worker processes and merge their results
+    worker        // Render tiles for a coordinator
+};
+
+struct cluster_options {
+    cluster_role role    = cluster_role::standalone;
+    std::string  host    = "127.0.0.1";  // Coordinator address
+    int          port    = 0;            // Coordinator port (0 lets the coordinator pick one)
+    int          workers = 0;            // Local worker processes the coordinator spawns
+    int          threads = 0;            // Overrides camera::thread_count when positive
+    double       worker_timeout = 30;    // Seconds a coordinator with no workers waits before rendering locally
+};
+
+inline cluster_options cluster_config;
+
+inline bool parse_cluster_arguments(int argc, char* argv[]) {
+    // Fills cluster_config from the command line:
+    //   --coordinator N     hand tiles to N spawned local workers (and any that connect)
+    //   --worker HOST:PORT  render tiles for the coordinator at HOST:PORT
+    //   --port P            port the coordinator listens on
+    //   --threads T         render threads in this process
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << arg << ".\n";
+            return false;
+        }
+        std::string value = argv[++i];
+
+        if (arg == "--coordinator") {
+            cluster_config.role = cluster_role::coordinator;
+            cluster_config.workers = std::atoi(value.c_str());
+        } else if (arg == "--worker") {
+            auto colon = value.rfind(':');
+            if (colon == std::string::npos) {
+                std::cerr << "--worker expects HOST:PORT.\n";
+                return false;
+            }
+            cluster_config.role = cluster_role::worker;
+            cluster_config.host = value.substr(0, colon);
+            cluster_config.port = std::atoi(value.c_str() + colon + 1);
+        } else if (arg == "--port") {
+            cluster_config.port = std::atoi(value.c_str());
+        } else if (arg == "--threads") {
+            cluster_config.threads = std::atoi(value.c_str());
+        } else {
+            std::cerr << "Unknown option " << arg << ".\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+class cluster_connection {
+  public:
+    // Blocking, length-checked message I/O over a connected TCP socket.
+
+    explicit cluster_connection(int fd) : fd(fd) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    ~cluster_connection() { if (fd >= 0) ::close(fd); }
+
+    cluster_connection(const cluster_connection&) = delete;
+    cluster_connection& operator=(const cluster_connection&) = delete;
+
+    bool send_bytes(const void* data, size_t size) {
+        auto bytes = static_cast<const char*>(data);
+        while (size > 0) {
+            // MSG_NOSIGNAL: a dead peer must surface as an error here, not kill us with SIGPIPE.
+            auto n = ::send(fd, bytes, size, MSG_NOSIGNAL);
+            if (n <= 0)
+                return false;
+            bytes += n;
+            size -= size_t(n);
+        }
+        return true;
+    }
+
+    bool recv_bytes(void* data, size_t size) {
+        auto bytes = static_cast<char*>(data);
+        while (size > 0) {
+            auto n = ::recv(fd, bytes, size, 0);
+            if (n <= 0)
+                return false;
+            bytes += n;
+            size -= size_t(n);
+        }
+        return true;
+    }
+
+    template <typename T>
+    bool send_value(const T& value) { return send_bytes(&value, sizeof(T)); }
+
+    template <typename T>
+    bool recv_value(T& value) { return recv_bytes(&value, sizeof(T)); }
+
+    bool send_film(const film& part) {
+        std::ostringstream buffer;
+        part.write_pixels(buffer);
+        auto blob = buffer.str();
+        return send_value(uint64_t(blob.size())) && send_bytes(blob.data(), blob.size());
+    }
+
+    bool recv_film(film& part, int width, int height) {
+        // Receives a film that must be width x height; anything else, or a size prefix larger
+        // than such a film needs, is refused before its buffer is allocated.
+        if (width <= 0 || height <= 0 || width > max_tile_side || height > max_tile_side)
+            return false;
+        uint64_t size;
+        if (!recv_value(size) || size > film::serialized_size(width, height))
+            return false;
+        std::string blob(size, '\0');
+        if (!recv_bytes(&blob[0], size))
+            return false;
+        std::istringstream buffer(blob);
+        return part.read_pixels(buffer, width, height);
+    }
+
+  private:
+    static constexpr int max_tile_side = 1 << 16;  // Far beyond any tile a camera deals out
+
+    int fd;
+};
+
+namespace cluster_protocol {
+    const uint32_t magic = 0x31435452;  // "RTC1"
+
+    enum message : uint32_t {
+        hello = 1,  // Worker -> coordinator: magic, job key
+        accept,     // Coordinator -> worker: job keys match
+        reject,     // Coordinator -> worker: worker is set up for a different render
+        work,       // Coordinator -> worker: tile, sample target, current pixels of the tile
+        result,     // Worker -> coordinator: tile index, finished pixels of the tile
+        done        // Coordinator -> worker: no tiles left
+    };
+}
+
+using region_renderer = std::function<void(film& part, const tile& t, int target)>;
+
+inline bool serve_cluster_tiles(uint64_t job_key, int connection_count, const region_renderer& render_region) {
+    // Worker side. Opens connection_count connections to the coordinator, each served by its own
+    // thread, and renders tiles until told there are none left. Returns false if the
+    // coordinator could not be reached or is rendering something else.
+    std::atomic<bool> accepted{false};
+
+    auto serve = [&] {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(uint16_t(cluster_config.port));
+        if (inet_pton(AF_INET, cluster_config.host.c_str(), &addr.sin_addr) != 1)
+            return;
+
+        // The coordinator may not be listening yet, so keep trying for a while.
+        int fd = -1;
+        for (int attempt = 0; attempt < 30; attempt++) {
+            fd = ::socket(AF_INET, SOCK_STREAM, 0);
+            if (fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+                break;
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+        if (fd < 0)
+            return;
+
+        cluster_connection conn(fd);
+        uint32_t reply;
+        if (!conn.send_value(uint32_t(cluster_protocol::hello)) || !conn.send_value(cluster_protocol::magic)
+            || !conn.send_value(job_key) || !conn.recv_value(reply) || reply != cluster_protocol::accept)
+            return;
+        accepted = true;
+
+        uint32_t type;
+        while (conn.recv_value(type) && type == cluster_protocol::work) {
+            tile t;
+            int32_t target;
+            film part;
+            if (!conn.recv_value(t) || !conn.recv_value(target)
+                || !conn.recv_film(part, t.x1 - t.x0, t.y1 - t.y0))
+                return;
+
+            render_region(part, t, target);
+
+            if (!conn.send_value(uint32_t(cluster_protocol::result)) || !conn.send_value(int32_t(t.index))
+                || !conn.send_film(part))
+                return;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int c = 1; c < connection_count; c++)
+        threads.emplace_back(serve);
+    serve();
+    for (auto& th : threads) th.join();
+
+    return accepted;
+}
+
+class cluster_coordinator {
+  public:
+    // Coordinator side. fetch returns a tile's current pixels, commit stores finished ones and
+    // render_local renders a tile in this process, which is the fallback if every spawned
+    // worker has died. Workers stay connected from start() until the coordinator is destroyed,
+    // so a progressive render reuses them for every pass.
+
+    cluster_coordinator(
+        uint64_t job_key,
+        const std::vector<tile>& tiles,
+        std::function<film(const tile&)> fetch,
+        std::function<void(const tile&, const film&)> commit,
+        std::function<void(const tile&, int worker_id)> render_local
+    ) : job_key(job_key), tiles(tiles), fetch(fetch), commit(commit), render_local(render_local) {}
+
+    ~cluster_coordinator() { finish(); }
+
+    bool start(int local_threads) {
+        // Opens the listening socket and spawns the local workers. Returns false if the
+        // coordinator cannot listen.
+        listen_fd = open_listener();
+        if (listen_fd < 0)
+            return false;
+        children = spawn_workers(local_threads);
+        return true;
+    }
+
+    void run_pass(int target, int local_threads) {
+        // Brings every tile up to `target` samples per pixel.
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            sample_target = target;
+            pending.clear();
+            for (size_t t = 0; t < tiles.size(); t++)
+                pending.push_back(int(t));
+            completed = 0;
+        }
+        changed.notify_all();
+
+        // With no worker connected and none spawned still alive, the pass is rendered here:
+        // at once if spawned workers have all died or an earlier pass already gave up on
+        // them, or after worker_timeout seconds if the coordinator is waiting for remote
+        // workers that never come.
+        using clock = std::chrono::steady_clock;
+        auto idle_since = clock::now();
+        auto timeout = std::chrono::duration<double>(cluster_config.worker_timeout);
+
+        while (!pass_finished()) {
+            pollfd pfd{listen_fd, POLLIN, 0};
+            if (::poll(&pfd, 1, 200) > 0 && (pfd.revents & POLLIN)) {
+                int fd = ::accept(listen_fd, nullptr, nullptr);
+                if (fd >= 0)
+                    connections.emplace_back(&cluster_coordinator::serve_worker, this, fd);
+            }
+
+            if (live_connections > 0 || !all_exited(children)) {
+                idle_since = clock::now();
+                continue;
+            }
+
+            bool spawned_lost = cluster_config.workers > 0;
+            if (!pass_finished() && (workers_lost || spawned_lost || clock::now() - idle_since >= timeout)) {
+                if (!workers_lost) {
+                    if (spawned_lost)
+                        std::clog << "\nAll workers have exited; rendering the remaining tiles locally.\n";
+                    else
+                        std::clog << "\nNo worker has connected; rendering the remaining tiles locally.\n";
+                }
+                workers_lost = true;
+                render_remaining(local_threads);
+            }
+        }
+    }
+
+    void finish() {
+        if (listen_fd < 0)
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            shutting_down = true;
+        }
+        changed.notify_all();
+
+        ::close(listen_fd);
+        listen_fd = -1;
+        for (auto& th : connections) th.join();
+        connections.clear();
+
+        // Workers that never connected are still retrying; nothing is left for them to do.
+        for (auto pid : children) {
+            if (pid > 0) {
+                ::kill(pid, SIGTERM);
+                ::waitpid(pid, nullptr, 0);
+            }
+        }
+        children.clear();
+    }
+
+  private:
+    uint64_t job_key;
+    std::vector<tile> tiles;
+    std::function<film(const tile&)> fetch;
+    std::function<void(const tile&, const film&)> commit;
+    std::function<void(const tile&, int)> render_local;
+
+    int listen_fd = -1;
+    std::vector<pid_t> children;
+    std::vector<std::thread> connections;
+    bool workers_lost = false;
+
+    std::mutex mtx;
+    std::condition_variable changed;
+    std::deque<int> pending;            // Tiles of the current pass waiting for a worker
+    size_t completed = 0;               // Tiles of the current pass that are finished
+    int sample_target = 0;
+    bool shutting_down = false;
+    std::atomic<int> live_connections{0};
+
+    bool pass_finished() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return completed == tiles.size();
+    }
+
+    int open_listener() {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(uint16_t(cluster_config.port));
+        if (inet_pton(AF_INET, cluster_config.host.c_str(), &addr.sin_addr) != 1
+            || ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(fd, 64) != 0) {
+            std::cerr << "Coordinator could not listen on " << cluster_config.host << ':'
+                      << cluster_config.port << ".\n";
+            ::close(fd);
+            return -1;
+        }
+
+        // With port 0 the system picked one; the spawned workers need to know which.
+        socklen_t len = sizeof(addr);
+        getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len);
+        cluster_config.port = ntohs(addr.sin_port);
+        std::clog << "Coordinator listening on " << cluster_config.host << ':' << cluster_config.port << '\n';
+        return fd;
+    }
+
+    std::vector<pid_t> spawn_workers(int local_threads) {
+        std::vector<pid_t> spawned;
+        if (cluster_config.workers <= 0)
+            return spawned;
+
+        auto address = cluster_config.host + ":" + std::to_string(cluster_config.port);
+        auto threads = std::to_string(std::max(1, resolve_worker_count(local_threads) / cluster_config.workers));
+
+        for (int w = 0; w < cluster_config.workers; w++) {
+            pid_t pid = ::fork();
+            if (pid == 0) {
+                const char* args[] = {"raytracing", "--worker", address.c_str(), "--threads", threads.c_str(), nullptr};
+                ::execv("/proc/self/exe", const_cast<char* const*>(args));
+                ::_exit(127);
+            }
+            if (pid > 0)
+                spawned.push_back(pid);
+        }
+        return spawned;
+    }
+
+    static bool all_exited(std::vector<pid_t>& pids) {
+        // Reaps any exited workers, marking their slots with a negated pid.
+        bool all = true;
+        for (auto& pid : pids) {
+            if (pid > 0 && ::waitpid(pid, nullptr, WNOHANG) == pid)
+                pid = -pid;
+            all = all && pid <= 0;
+        }
+        return all;
+    }
+
+    void render_remaining(int local_threads) {
+        std::vector<tile> remaining;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            for (auto t : pending)
+                remaining.push_back(tiles[t]);
+            pending.clear();
+        }
+
+        tile_scheduler(remaining).run(local_threads, [&](const tile& t, int worker_id) {
+            render_local(t, worker_id);
+            std::lock_guard<std::mutex> lock(mtx);
+            completed++;
+        });
+        changed.notify_all();
+    }
+
+    void serve_worker(int fd) {
+        cluster_connection conn(fd);
+
+        uint32_t type, magic;
+        uint64_t key;
+        if (!conn.recv_value(type) || type != cluster_protocol::hello || !conn.recv_value(magic)
+            || magic != cluster_protocol::magic || !conn.recv_value(key))
+            return;
+
+        if (key != job_key) {
+            conn.send_value(uint32_t(cluster_protocol::reject));
+            return;
+        }
+        if (!conn.send_value(uint32_t(cluster_protocol::accept)))
+            return;
+
+        live_connections++;
+        while (true) {
+            int t, target;
+            {
+                // A tile can be pending again later if the worker holding it dies, and the next
+                // pass refills the queue, so idle workers wait here until shutdown.
+                std::unique_lock<std::mutex> lock(mtx);
+                changed.wait(lock, [&] { return !pending.empty() || shutting_down; });
+                if (pending.empty()) {
+                    conn.send_value(uint32_t(cluster_protocol::done));
+                    break;
+                }
+                t = pending.front();
+                pending.pop_front();
+                target = sample_target;
+            }
+
+            if (!issue_tile(conn, tiles[t], target)) {
+                // The worker died or misbehaved: put its tile back for someone else.
+                std::lock_guard<std::mutex> lock(mtx);
+                pending.push_front(t);
+                changed.notify_all();
+                break;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                completed++;
+            }
+            changed.notify_all();
+        }
+        live_connections--;
+    }
+
+    bool issue_tile(cluster_connection& conn, const tile& t, int target) {
+        film part = fetch(t);
+        uint32_t type;
+        int32_t index;
+        if (!conn.send_value(uint32_t(cluster_protocol::work)) || !conn.send_value(t)
+            || !conn.send_value(int32_t(target)) || !conn.send_film(part)
+            || !conn.recv_value(type) || type != cluster_protocol::result || !conn.recv_value(index)
+            || index != t.index || !conn.recv_film(part, t.x1 - t.x0, t.y1 - t.y0))
+            return false;
+
+        commit(t, part);
+        return true;
+    }
+};
+
+#endif
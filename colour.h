@@ -14,21 +14,9 @@ inline double linear_to_gamma(double linear_component)
     return 0;
 }
 
-void write_colour(std::ostream& out, const colour& pixel_colour) {
-    auto r = pixel_colour.x();
-    auto g = pixel_colour.y();
-    auto b = pixel_colour.z();
-
-    r = linear_to_gamma(r);
-    g = linear_to_gamma(g);
-    b = linear_to_gamma(b);
-
-    static const interval intensity(0.000, 0.999);
-    int rbyte = int(256 * intensity.clamp(r));
-    int gbyte = int(256 * intensity.clamp(g));
-    int bbyte = int(256 * intensity.clamp(b));
-
-    out << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';
+inline double luminance(const colour& c) {
+    // Relative luminance of a linear Rec. 709 colour.
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
 }
 
 static colour random(std::mt19937& rng) {
@@ -0,0 +1,634 @@
+#ifndef COMPILED_SCENE_H
+#define COMPILED_SCENE_H
+
+#include "bvh.h"
+#include "constant_medium.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "quad.h"
+#include "shapes.h"
+#include <typeinfo>
+#include <unordered_map>
+
+class compiled_scene : public hittable {
+  public:
+    // A flattened copy of a hittable graph for tracing. Spheres, quads (and so boxes),
+    // transforms and media become plain records in one array per kind, and each leaf of a
+    // level's BVH holds tagged references that a switch dispatches on, so the hot path makes
+    // no virtual calls and touches no reference counts. Lists and BVHs are dissolved into the
+    // level that holds them, and a transform or medium points at the level compiled from the
+    // object it wraps; a shared object is compiled once however many instances refer to it.
+    //
+    // Hittables that already pack their own primitives (triangle_mesh, sphere_set, streamed
+    // geometry, the wide BVHs), BVHs loaded from a cache file, and types the compiler does not
+    // know are kept as external records, traced with one virtual call. A level dissolved from
+    // a bvh_node is rebuilt with that node's options; other levels use `options`. Records do
+    // not own the graph, so it must outlive the compiled scene. Every record repeats its
+    // source's arithmetic, so a compiled scene renders the same image as the graph it came from.
+    //
+    // Compiling costs about as much as building the graph's BVHs, so build one compiled scene
+    // and keep it: after moving objects between frames, update() brings it up to date as
+    // bvh_node::update() does. Objects added to or removed from the graph need a new one;
+    // compiled_from() tells whether that has happened.
+
+    explicit compiled_scene(const hittable& world, const bvh_build_options& options = {})
+      : options(options), world(&world), world_generation(world.generation()), bbox(world.bounding_box())
+    {
+        root = compile(&world);
+    }
+
+    bool compiled_from(const hittable& graph) const {
+        // True if `graph` is the object this scene was compiled from and no list, BVH or
+        // wrapper in it has had its children changed since. Generations are never reused, so
+        // this holds even if the original graph was destroyed and another built at the same
+        // address.
+        if (graph.generation() != world_generation)
+            return false;
+        // Parents were recorded before their children, and a parent that is unchanged still
+        // owns its children, so each pointer is valid when it is reached.
+        for (const auto& [object, generation] : structure) {
+            if (object->generation() != generation)
+                return false;
+        }
+        return true;
+    }
+
+    bool update() {
+        // Copies every record's parameters from its source again, so moved, resized or
+        // rotated objects and changed materials or densities are picked up, and refits every
+        // level, rebuilding any level that refitting leaves rebuild_cost_ratio times costlier
+        // than when it was built. Which object a transform or medium wraps is structure, and
+        // is not refreshed. It must not run while rays are being traced. Returns true if any
+        // level was rebuilt.
+        for (size_t i = 0; i < sphere_sources.size(); i++)
+            spheres[i] = make_record(*sphere_sources[i]);
+        for (size_t i = 0; i < quad_sources.size(); i++)
+            quads[i] = make_record(*quad_sources[i]);
+        for (size_t i = 0; i < translate_sources.size(); i++)
+            translates[i].offset = translate_sources[i]->offset;
+        for (size_t i = 0; i < rotation_sources.size(); i++) {
+            rotations[i].sin_theta = rotation_sources[i]->sin_theta;
+            rotations[i].cos_theta = rotation_sources[i]->cos_theta;
+        }
+        for (size_t i = 0; i < instance_sources.size(); i++)
+            instances[i].to_world = instance_sources[i]->to_world;
+        for (size_t i = 0; i < medium_sources.size(); i++) {
+            auto m = medium_sources[i];
+            media[i].neg_inv_density = m->neg_inv_density;
+            media[i].salt = m->salt;
+            media[i].material = m->phase_function.id();
+        }
+
+        bool rebuilt = false;
+        for (auto& compiled : levels) {
+            linear_bvh::refit(compiled.nodes.data(), compiled.nodes.size(),
+                              [&](uint32_t slot) { return compiled.sources[slot]->bounding_box(); });
+            auto cost = linear_bvh::sah_cost(compiled.nodes.data(), compiled.nodes.size(), compiled.options);
+            if (cost > compiled.options.rebuild_cost_ratio * compiled.build_cost) {
+                std::vector<bvh_primitive> prims(compiled.primitives.size());
+                for (size_t slot = 0; slot < prims.size(); slot++) {
+                    auto box = compiled.sources[slot]->bounding_box();
+                    prims[slot] = {box, box.centroid(), slot};
+                }
+                auto refs = compiled.primitives;
+                auto sources = compiled.sources;
+                build_level(compiled, refs, sources, std::move(prims));
+                rebuilt = true;
+            }
+        }
+        bbox = world->bounding_box();
+        return rebuilt;
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        return hit_level(root, r, ray_t, rec, true);
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override {
+        return occluded_level(root, r, ray_t);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+  private:
+    enum class primitive_tag : uint8_t { sphere, quad, translate, rotate_y, instance, medium, external };
+
+    struct primitive_ref {
+        primitive_tag tag;
+        uint32_t      index;  // Into the record array for the tag
+    };
+
+    struct level {
+        // One BVH over the primitives of a list, BVH or transformed object, leaves holding
+        // ranges of `primitives` in leaf order. `sources` holds the object each primitive was
+        // compiled from, in the same order, for update().
+        std::vector<linear_bvh_node> nodes;
+        std::vector<primitive_ref>   primitives;
+        std::vector<const hittable*> sources;
+        bvh_build_options options;
+        double build_cost = 0;
+    };
+
+    struct sphere_record {
+        ray         center;
+        double      radius;
+        material_id material;
+    };
+
+    struct quad_record {
+        point3      Q;
+        vec3        u, v, w;
+        vec3        normal;
+        double      D;
+        material_id material;
+    };
+
+    struct translate_record {
+        vec3     offset;
+        uint32_t object;  // Level
+    };
+
+    struct rotate_y_record {
+        double   sin_theta, cos_theta;
+        uint32_t object;
+    };
+
+    struct instance_record {
+        affine_transform to_world;
+        uint32_t         object;
+    };
+
+    struct medium_record {
+        double      neg_inv_density;
+        uint64_t    salt;
+        uint32_t    boundary;
+        material_id material;
+    };
+
+    bvh_build_options options;
+    const hittable* world;
+    uint64_t world_generation;
+    aabb bbox;
+    uint32_t root;
+    std::vector<level> levels;
+    std::vector<sphere_record>    spheres;
+    std::vector<quad_record>      quads;
+    std::vector<translate_record> translates;
+    std::vector<rotate_y_record>  rotations;
+    std::vector<instance_record>  instances;
+    std::vector<medium_record>    media;
+    std::vector<const hittable*>  externals;
+    std::vector<const sphere*>          sphere_sources;     // Parallel to spheres, for update()
+    std::vector<const quad*>            quad_sources;       // Parallel to quads
+    std::vector<const translate*>       translate_sources;  // Parallel to translates
+    std::vector<const rotate_y*>        rotation_sources;   // Parallel to rotations
+    std::vector<const instance*>        instance_sources;   // Parallel to instances
+    std::vector<const constant_medium*> medium_sources;     // Parallel to media
+    std::vector<std::pair<const hittable*, uint64_t>> structure;  // Objects with children, parents first
+    std::unordered_map<const hittable*, uint32_t> compiled_levels;
+
+    static sphere_record make_record(const sphere& s) { return {s.center, s.radius, s.mat.id()}; }
+
+    static quad_record make_record(const quad& q) { return {q.Q, q.u, q.v, q.w, q.normal, q.D, q.mat.id()}; }
+
+    uint32_t compile(const hittable* object) {
+        // Returns the level holding `object`, compiling it on first use.
+        auto found = compiled_levels.find(object);
+        if (found != compiled_levels.end())
+            return found->second;
+
+        auto index = uint32_t(levels.size());
+        levels.emplace_back();
+        compiled_levels[object] = index;
+
+        std::vector<primitive_ref> refs;
+        std::vector<const hittable*> sources;
+        std::vector<bvh_primitive> prims;
+        const bvh_build_options* level_options = nullptr;
+        gather(object, refs, sources, prims, level_options);
+
+        // Levels are only reached through `levels` from here on, as compiling the objects
+        // gathered above may have grown it.
+        auto& compiled = levels[index];
+        compiled.options = level_options ? *level_options : options;
+        compiled.options.cache_path.clear();
+        build_level(compiled, refs, sources, std::move(prims));
+        return index;
+    }
+
+    static void build_level(
+        level& compiled, const std::vector<primitive_ref>& refs, const std::vector<const hittable*>& sources,
+        std::vector<bvh_primitive> prims
+    ) {
+        linear_bvh tree(std::move(prims), compiled.options);
+        compiled.nodes = std::move(tree.nodes);
+        compiled.primitives.clear();
+        compiled.sources.clear();
+        compiled.primitives.reserve(tree.primitive_order.size());
+        compiled.sources.reserve(tree.primitive_order.size());
+        for (auto i : tree.primitive_order) {
+            compiled.primitives.push_back(refs[i]);
+            compiled.sources.push_back(sources[i]);
+        }
+        compiled.build_cost = linear_bvh::sah_cost(compiled.nodes.data(), compiled.nodes.size(), compiled.options);
+    }
+
+    void gather(
+        const hittable* object, std::vector<primitive_ref>& refs, std::vector<const hittable*>& sources,
+        std::vector<bvh_primitive>& prims, const bvh_build_options*& level_options
+    ) {
+        // Appends the records for `object` to a level under construction. Types are matched
+        // exactly, so a subclass that overrides part of a shape's behaviour stays external.
+        // The level takes the options of the outermost bvh_node dissolved into it.
+        const auto& type = typeid(*object);
+
+        if (type == typeid(hittable_list)) {
+            structure.push_back({object, object->generation()});
+            for (const auto& child : static_cast<const hittable_list*>(object)->objects)
+                gather(child.get(), refs, sources, prims, level_options);
+            return;
+        }
+        if (type == typeid(bvh_node)) {
+            // A tree mapped from a cache file is kept whole, as it is already built.
+            auto node = static_cast<const bvh_node*>(object);
+            if (!node->cache) {
+                if (!level_options)
+                    level_options = &node->options;
+                structure.push_back({object, object->generation()});
+                for (const auto& child : node->source_objects)
+                    gather(child.get(), refs, sources, prims, level_options);
+                return;
+            }
+        }
+
+        primitive_ref ref;
+        bool wrapper = type == typeid(translate) || type == typeid(rotate_y) || type == typeid(instance)
+                    || type == typeid(constant_medium);
+        if (wrapper)
+            structure.push_back({object, object->generation()});
+        if (type == typeid(sphere)) {
+            auto s = static_cast<const sphere*>(object);
+            ref = {primitive_tag::sphere, uint32_t(spheres.size())};
+            spheres.push_back(make_record(*s));
+            sphere_sources.push_back(s);
+        } else if (type == typeid(quad)) {
+            auto q = static_cast<const quad*>(object);
+            ref = {primitive_tag::quad, uint32_t(quads.size())};
+            quads.push_back(make_record(*q));
+            quad_sources.push_back(q);
+        } else if (type == typeid(translate)) {
+            auto t = static_cast<const translate*>(object);
+            auto level = compile(t->object.get());
+            ref = {primitive_tag::translate, uint32_t(translates.size())};
+            translates.push_back({t->offset, level});
+            translate_sources.push_back(t);
+        } else if (type == typeid(rotate_y)) {
+            auto t = static_cast<const rotate_y*>(object);
+            auto level = compile(t->object.get());
+            ref = {primitive_tag::rotate_y, uint32_t(rotations.size())};
+            rotations.push_back({t->sin_theta, t->cos_theta, level});
+            rotation_sources.push_back(t);
+        } else if (type == typeid(instance)) {
+            auto t = static_cast<const instance*>(object);
+            auto level = compile(t->object.get());
+            ref = {primitive_tag::instance, uint32_t(instances.size())};
+            instances.push_back({t->to_world, level});
+            instance_sources.push_back(t);
+        } else if (type == typeid(constant_medium)) {
+            auto m = static_cast<const constant_medium*>(object);
+            auto level = compile(m->boundary.get());
+            ref = {primitive_tag::medium, uint32_t(media.size())};
+            media.push_back({m->neg_inv_density, m->salt, level, m->phase_function.id()});
+            medium_sources.push_back(m);
+        } else {
+            ref = {primitive_tag::external, uint32_t(externals.size())};
+            externals.push_back(object);
+        }
+
+        auto box = object->bounding_box();
+        prims.push_back({box, box.centroid(), refs.size()});
+        refs.push_back(ref);
+        sources.push_back(object);
+    }
+
+    bool hit_level(uint32_t index, const ray& r, interval ray_t, hit_record& rec, bool surface) const {
+        // Closest hit among a level's primitives. Spheres and quads only report their distance
+        // during the walk; the surface of the one that turns out nearest is filled in at the
+        // end, and not at all when the caller only needs rec.t (`surface` false).
+        const auto& nodes = levels[index].nodes;
+        const auto& primitives = levels[index].primitives;
+        if (nodes.empty())
+            return false;
+
+        const point3& origin = r.origin();
+        const vec3& direction = r.direction();
+        vec3 inv_dir(1.0 / direction.x(), 1.0 / direction.y(), 1.0 / direction.z());
+        bool dir_is_neg[3] = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
+
+        bool hit_anything = false;
+        const primitive_ref* deferred = nullptr;  // Nearest hit so far, if its surface is pending
+        uint32_t stack[linear_bvh::max_depth];
+        int stack_size = 0;
+        uint32_t current = 0;
+
+        while (true) {
+            const auto& node = nodes[current];
+            trace_stats::node_visit(1);
+            if (linear_bvh::node_hit(node, origin, inv_dir, ray_t)) {
+                if (node.count > 0) {
+                    trace_stats::primitive_tests(node.count);
+                    for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                        const auto& ref = primitives[i];
+                        double t;
+                        bool found;
+                        switch (ref.tag) {
+                            case primitive_tag::sphere:
+                                found = hit_sphere(spheres[ref.index], r, ray_t, t);
+                                break;
+                            case primitive_tag::quad:
+                                found = hit_quad(quads[ref.index], r, ray_t, t);
+                                break;
+                            default:
+                                found = hit_nested(ref, r, ray_t, rec, surface);
+                                t = rec.t;
+                                break;
+                        }
+                        if (found) {
+                            hit_anything = true;
+                            ray_t.max = t;
+                            bool pending = ref.tag == primitive_tag::sphere || ref.tag == primitive_tag::quad;
+                            deferred = pending ? &ref : nullptr;
+                        }
+                    }
+                    if (stack_size == 0)
+                        break;
+                    current = stack[--stack_size];
+                } else if (dir_is_neg[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+            } else {
+                if (stack_size == 0)
+                    break;
+                current = stack[--stack_size];
+            }
+        }
+
+        if (deferred) {
+            rec.t = ray_t.max;
+            if (surface && deferred->tag == primitive_tag::sphere)
+                sphere_surface(spheres[deferred->index], r, rec);
+            else if (surface)
+                quad_surface(quads[deferred->index], r, rec);
+        }
+        return hit_anything;
+    }
+
+    bool hit_nested(const primitive_ref& ref, const ray& r, const interval& ray_t, hit_record& rec, bool surface) const {
+        switch (ref.tag) {
+            case primitive_tag::translate: {
+                const auto& t = translates[ref.index];
+                ray offset_r(r.origin() - t.offset, r.direction(), r.time());
+                if (!hit_level(t.object, offset_r, ray_t, rec, surface))
+                    return false;
+                rec.p += t.offset;
+                return true;
+            }
+            case primitive_tag::rotate_y: {
+                const auto& t = rotations[ref.index];
+                if (!hit_level(t.object, to_object(t, r), ray_t, rec, surface))
+                    return false;
+                if (surface) {
+                    rec.p = from_object(t, rec.p);
+                    rec.normal = from_object(t, rec.normal);
+                }
+                return true;
+            }
+            case primitive_tag::instance: {
+                const auto& t = instances[ref.index];
+                ray object_r(t.to_world.inverse_point(r.origin()), t.to_world.inverse_vector(r.direction()), r.time());
+                if (!hit_level(t.object, object_r, ray_t, rec, surface))
+                    return false;
+                if (surface) {
+                    rec.p = t.to_world.point(rec.p);
+                    rec.normal = unit_vector(t.to_world.normal(rec.normal));
+                }
+                return true;
+            }
+            case primitive_tag::medium:
+                return hit_medium(media[ref.index], r, ray_t, rec);
+            default:
+                return externals[ref.index]->hit(r, ray_t, rec);
+        }
+    }
+
+    static bool hit_sphere(const sphere_record& s, const ray& r, const interval& ray_t, double& t) {
+        point3 current_center = s.center.at(r.time());
+        vec3 oc = current_center - r.origin();
+        auto a = r.direction().length_squared();
+        auto h = dot(r.direction(), oc);
+        auto c = oc.length_squared() - s.radius*s.radius;
+
+        auto discriminant = h*h - a*c;
+        if (discriminant < 0)
+            return false;
+
+        auto sqrtd = std::sqrt(discriminant);
+        t = (h - sqrtd) / a;
+        if (!ray_t.surrounds(t)) {
+            t = (h + sqrtd) / a;
+            if (!ray_t.surrounds(t))
+                return false;
+        }
+        return true;
+    }
+
+    static void sphere_surface(const sphere_record& s, const ray& r, hit_record& rec) {
+        point3 current_center = s.center.at(r.time());
+        rec.p = r.at(rec.t);
+        vec3 outward_normal = (rec.p - current_center) / s.radius;
+        rec.set_face_normal(r, outward_normal);
+        sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+        rec.mat = s.material;
+    }
+
+    static bool hit_quad(const quad_record& q, const ray& r, const interval& ray_t, double& t) {
+        auto denom = dot(q.normal, r.direction());
+        if (std::fabs(denom) < 1e-8)
+            return false;
+
+        t = (q.D - dot(q.normal, r.origin())) / denom;
+        if (!ray_t.contains(t))
+            return false;
+
+        double alpha, beta;
+        plane_coordinates(q, r.at(t), alpha, beta);
+        return interval(0, 1).contains(alpha) && interval(0, 1).contains(beta);
+    }
+
+    static void quad_surface(const quad_record& q, const ray& r, hit_record& rec) {
+        rec.p = r.at(rec.t);
+        plane_coordinates(q, rec.p, rec.u, rec.v);
+        rec.set_face_normal(r, q.normal);
+        rec.mat = q.material;
+    }
+
+    static void plane_coordinates(const quad_record& q, const point3& p, double& alpha, double& beta) {
+        vec3 planar_hitpt_vector = p - q.Q;
+        alpha = dot(q.w, cross(planar_hitpt_vector, q.v));
+        beta = dot(q.w, cross(q.u, planar_hitpt_vector));
+    }
+
+    bool hit_medium(const medium_record& m, const ray& r, const interval& ray_t, hit_record& rec) const {
+        // constant_medium::hit, with the boundary's hits reduced to their distances.
+        hit_record rec1, rec2;
+
+        if (!hit_level(m.boundary, r, interval::universe, rec1, false))
+            return false;
+
+        if (!hit_level(m.boundary, r, interval(rec1.t+0.0001, infinity), rec2, false))
+            return false;
+
+        if (rec1.t < ray_t.min) rec1.t = ray_t.min;
+        if (rec2.t > ray_t.max) rec2.t = ray_t.max;
+
+        if (rec1.t >= rec2.t)
+            return false;
+
+        if (rec1.t < 0)
+            rec1.t = 0;
+
+        auto ray_length = r.direction().length();
+        auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
+        auto hit_distance = m.neg_inv_density * std::log(constant_medium::free_flight_sample(r, m.salt));
+
+        if (hit_distance > distance_inside_boundary)
+            return false;
+
+        rec.t = rec1.t + hit_distance / ray_length;
+        rec.p = r.at(rec.t);
+        rec.normal = vec3(1,0,0);
+        rec.front_face = true;
+        rec.mat = m.material;
+        return true;
+    }
+
+    static ray to_object(const rotate_y_record& t, const ray& r) {
+        auto origin = point3(
+            (t.cos_theta * r.origin().x()) - (t.sin_theta * r.origin().z()),
+            r.origin().y(),
+            (t.sin_theta * r.origin().x()) + (t.cos_theta * r.origin().z())
+        );
+
+        auto direction = vec3(
+            (t.cos_theta * r.direction().x()) - (t.sin_theta * r.direction().z()),
+            r.direction().y(),
+            (t.sin_theta * r.direction().x()) + (t.cos_theta * r.direction().z())
+        );
+
+        return ray(origin, direction, r.time());
+    }
+
+    static vec3 from_object(const rotate_y_record& t, const vec3& v) {
+        return vec3(
+            (t.cos_theta * v.x()) + (t.sin_theta * v.z()),
+            v.y(),
+            (-t.sin_theta * v.x()) + (t.cos_theta * v.z())
+        );
+    }
+
+    bool occluded_level(uint32_t index, const ray& r, const interval& ray_t) const {
+        // The walk of hit_level, ending at the first primitive that blocks the ray.
+        const auto& nodes = levels[index].nodes;
+        const auto& primitives = levels[index].primitives;
+        if (nodes.empty())
+            return false;
+
+        const point3& origin = r.origin();
+        const vec3& direction = r.direction();
+        vec3 inv_dir(1.0 / direction.x(), 1.0 / direction.y(), 1.0 / direction.z());
+        bool dir_is_neg[3] = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
+
+        uint32_t stack[linear_bvh::max_depth];
+        int stack_size = 0;
+        uint32_t current = 0;
+
+        while (true) {
+            const auto& node = nodes[current];
+            trace_stats::node_visit(1);
+            if (linear_bvh::node_hit(node, origin, inv_dir, ray_t)) {
+                if (node.count > 0) {
+                    for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                        trace_stats::primitive_tests(1);
+                        if (occluded_primitive(primitives[i], r, ray_t))
+                            return true;
+                    }
+                    if (stack_size == 0)
+                        break;
+                    current = stack[--stack_size];
+                } else if (dir_is_neg[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+            } else {
+                if (stack_size == 0)
+                    break;
+                current = stack[--stack_size];
+            }
+        }
+
+        return false;
+    }
+
+    bool occluded_primitive(const primitive_ref& ref, const ray& r, const interval& ray_t) const {
+        switch (ref.tag) {
+            case primitive_tag::sphere: {
+                // Either root inside ray_t will do.
+                const auto& s = spheres[ref.index];
+                vec3 oc = s.center.at(r.time()) - r.origin();
+                auto a = r.direction().length_squared();
+                auto h = dot(r.direction(), oc);
+                auto c = oc.length_squared() - s.radius*s.radius;
+
+                auto discriminant = h*h - a*c;
+                if (discriminant < 0)
+                    return false;
+
+                auto sqrtd = std::sqrt(discriminant);
+                return ray_t.surrounds((h - sqrtd) / a) || ray_t.surrounds((h + sqrtd) / a);
+            }
+            case primitive_tag::quad: {
+                double t;
+                return hit_quad(quads[ref.index], r, ray_t, t);
+            }
+            case primitive_tag::translate: {
+                const auto& t = translates[ref.index];
+                return occluded_level(t.object, ray(r.origin() - t.offset, r.direction(), r.time()), ray_t);
+            }
+            case primitive_tag::rotate_y: {
+                const auto& t = rotations[ref.index];
+                return occluded_level(t.object, to_object(t, r), ray_t);
+            }
+            case primitive_tag::instance: {
+                const auto& t = instances[ref.index];
+                ray object_r(t.to_world.inverse_point(r.origin()), t.to_world.inverse_vector(r.direction()), r.time());
+                return occluded_level(t.object, object_r, ray_t);
+            }
+            case primitive_tag::medium: {
+                // Media have no cheaper any-hit test than their hit().
+                hit_record rec;
+                return hit_medium(media[ref.index], r, ray_t, rec);
+            }
+            default:
+                return externals[ref.index]->occluded(r, ray_t);
+        }
+    }
+};
+
+#endif
@@ -10,12 +10,16 @@ class constant_medium : public hittable {
     constant_medium(shared_ptr<hittable> boundary, double density, shared_ptr<texture> tex)
       : boundary(boundary), neg_inv_density(-1/density),
         phase_function(make_shared<isotropic>(tex))
-    {}
+    {
+        set_salt();
+    }
 
     constant_medium(shared_ptr<hittable> boundary, double density, const colour& albedo)
       : boundary(boundary), neg_inv_density(-1/density),
         phase_function(make_shared<isotropic>(albedo))
-    {}
+    {
+        set_salt();
+    }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
         hit_record rec1, rec2;
@@ -37,7 +41,7 @@ class constant_medium : public hittable {
 
         auto ray_length = r.direction().length();
         auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
-        auto hit_distance = neg_inv_density * std::log(random_double());
+        auto hit_distance = neg_inv_density * std::log(free_flight_sample(r, salt));
 
         if (hit_distance > distance_inside_boundary)
             return false;
@@ -47,7 +51,7 @@ class constant_medium : public hittable {
 
         rec.normal = vec3(1,0,0);  // arbitrary
         rec.front_face = true;     // also arbitrary
-        rec.mat = phase_function;
+        rec.mat = phase_function.id();
 
         return true;
     }
@@ -55,9 +59,38 @@ class constant_medium : public hittable {
     aabb bounding_box() const override { return boundary->bounding_box(); }
 
   private:
+    friend class compiled_scene;
     shared_ptr<hittable> boundary;
     double neg_inv_density;
-    shared_ptr<material> phase_function;
+    material_handle phase_function;
+    uint64_t salt;
+
+    void set_salt() {
+        // Distinguishes this medium's draws from those of other media the same ray crosses.
+        hasher h;
+        h.add(neg_inv_density);
+        h.add(boundary->bounding_box());
+        salt = h.value();
+    }
+
+    static double free_flight_sample(const ray& r, uint64_t salt) {
+        // The free-flight draw is the sampler's value for the current bounce, so it varies with
+        // the pixel, sample and bounce, and repeated hit() calls for one ray agree. Shifting it
+        // by the salt (modulo 1) keeps media the same ray crosses from sharing it. Outside a
+        // render there is no sampler, and the ray itself is hashed instead.
+        auto u = path_sample::free_flight();
+        if (u >= 0) {
+            u += counter_rng::to_unit(salt);
+            return u >= 1 ? u - 1 : u;
+        }
+
+        hasher h;
+        h.add(r.origin());
+        h.add(r.direction());
+        h.add(r.time());
+        h.add(salt);
+        return counter_rng::to_unit(counter_rng::mix(h.value()));
+    }
 };
 
 #endif
\ No newline at end of file
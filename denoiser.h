@@ -0,0 +1,148 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include "film.h"
+#include "scheduler.h"
+
+#include <vector>
+
+class denoiser {
+  public:
+    // Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) with variance-guided colour
+    // weights as in SVGF. Radiance is divided by the first-hit albedo before filtering and
+    // multiplied back afterwards, so texture detail survives while the lighting is smoothed.
+    // Each iteration applies a 5x5 B3-spline kernel whose taps are spread 2^i pixels apart;
+    // normal, depth and albedo differences stop the filter at geometric edges.
+
+    int    iterations   = 5;    // Passes of the filter; each doubles its footprint
+    double colour_sigma = 4;    // Allowed luminance difference, in standard errors of the mean
+    double normal_power = 64;   // Sharpness of the normal edge-stopping term
+    double depth_sigma  = 0.1;  // Allowed relative depth difference per pixel of tap spacing
+    double albedo_sigma = 0.1;  // Allowed albedo difference
+
+    std::vector<float> filter(const film& image, int thread_count, int tile_size) const {
+        // Returns the filtered mean colour of `image` as packed, row-major RGB floats. The
+        // passes run over tiles on thread_count workers.
+        int width = image.width(), height = image.height();
+        size_t pixel_total = size_t(width) * height;
+
+        std::vector<surface_features> features(pixel_total);
+        std::vector<colour> albedo(pixel_total), irradiance(pixel_total), filtered(pixel_total);
+        std::vector<double> variance(pixel_total), filtered_variance(pixel_total);
+
+        const double epsilon = 1e-3;
+        for (int j = 0; j < height; j++) {
+            for (int i = 0; i < width; i++) {
+                auto index = size_t(j) * width + i;
+                features[index] = image.features(i, j);
+
+                auto a = features[index].albedo;
+                albedo[index] = colour(a.x() + epsilon, a.y() + epsilon, a.z() + epsilon);
+
+                auto c = image.mean(i, j);
+                irradiance[index] = colour(c.x() / albedo[index].x(), c.y() / albedo[index].y(),
+                                           c.z() / albedo[index].z());
+
+                // Variance of the mean luminance, carried into the demodulated space.
+                auto error = image.mean_error(i, j);
+                auto a_y = std::fmax(luminance(albedo[index]), epsilon);
+                variance[index] = std::isfinite(error) ? (error * error) / (a_y * a_y) : infinity;
+            }
+        }
+
+        tile_scheduler scheduler(width, height, tile_size);
+        for (int pass = 0; pass < iterations; pass++) {
+            int step = 1 << pass;
+            scheduler.run(thread_count, [&](const tile& t, int) {
+                for (int y = t.y0; y < t.y1; y++) {
+                    for (int x = t.x0; x < t.x1; x++) {
+                        auto index = size_t(y) * width + x;
+                        filter_pixel(x, y, step, width, height, features, irradiance, variance,
+                                     filtered[index], filtered_variance[index]);
+                    }
+                }
+            });
+            std::swap(irradiance, filtered);
+            std::swap(variance, filtered_variance);
+        }
+
+        std::vector<float> rgb(pixel_total * 3);
+        for (size_t index = 0; index < pixel_total; index++) {
+            rgb[3*index + 0] = float(irradiance[index].x() * albedo[index].x());
+            rgb[3*index + 1] = float(irradiance[index].y() * albedo[index].y());
+            rgb[3*index + 2] = float(irradiance[index].z() * albedo[index].z());
+        }
+        return rgb;
+    }
+
+  private:
+    void filter_pixel(
+        int x, int y, int step, int width, int height,
+        const std::vector<surface_features>& features, const std::vector<colour>& irradiance,
+        const std::vector<double>& variance, colour& out_colour, double& out_variance
+    ) const {
+        static const double kernel[3] = {3.0/8.0, 1.0/4.0, 1.0/16.0};
+
+        auto p = size_t(y) * width + x;
+        const auto& fp = features[p];
+        auto lum_p = luminance(irradiance[p]);
+
+        colour sum(0,0,0);
+        double weight_sum = 0;
+        double variance_sum = 0;
+        double variance_weight_sum = 0;  // Weights of the taps that have a variance estimate
+
+        for (int dy = -2; dy <= 2; dy++) {
+            int qy = y + dy * step;
+            if (qy < 0 || qy >= height)
+                continue;
+            for (int dx = -2; dx <= 2; dx++) {
+                int qx = x + dx * step;
+                if (qx < 0 || qx >= width)
+                    continue;
+
+                auto q = size_t(qy) * width + qx;
+                const auto& fq = features[q];
+
+                // Scaling by both pixels' variance keeps the weights symmetric, so a pixel that
+                // happened to see no bright paths does not push its brighter neighbours away.
+                // Pixels with fewer than two samples have no variance estimate and accept any colour.
+                auto colour_scale = colour_sigma * std::sqrt(variance[p] + variance[q]) + 1e-6;
+                auto w_colour = std::exp(-std::fabs(lum_p - luminance(irradiance[q])) / colour_scale);
+
+                // A missed ray has a zero normal, which only matches another miss.
+                double w_normal;
+                bool p_miss = fp.normal.length_squared() == 0, q_miss = fq.normal.length_squared() == 0;
+                if (p_miss || q_miss)
+                    w_normal = p_miss == q_miss ? 1 : 0;
+                else
+                    w_normal = std::pow(std::fmax(0.0, dot(fp.normal, fq.normal)), normal_power);
+
+                auto depth_scale = depth_sigma * step * std::fmin(fp.depth, fq.depth) + 1e-6;
+                auto w_depth = std::exp(-std::fabs(fp.depth - fq.depth) / depth_scale);
+
+                auto w_albedo = std::exp(-(fp.albedo - fq.albedo).length_squared() / (albedo_sigma * albedo_sigma));
+
+                auto w = kernel[std::abs(dx)] * kernel[std::abs(dy)] * w_colour * w_normal * w_depth * w_albedo;
+                if (w <= 0)
+                    continue;
+                sum += w * irradiance[q];
+                weight_sum += w;
+
+                // Taps without an estimate (infinite variance) are left out rather than
+                // turning the sum into inf, or NaN where w * w underflows.
+                if (std::isfinite(variance[q])) {
+                    variance_sum += w * w * variance[q];
+                    variance_weight_sum += w;
+                }
+            }
+        }
+
+        // The centre tap always has full weight, so weight_sum is never zero. The variance is
+        // estimated from the taps that have one, and stays unknown if none do.
+        out_colour = sum / weight_sum;
+        out_variance = variance_weight_sum > 0 ? variance_sum / (variance_weight_sum * variance_weight_sum) : infinity;
+    }
+};
+
+#endif
@@ -0,0 +1,299 @@
+#ifndef FILM_H
+#define FILM_H
+
+#include "raytracing.h"
+
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+struct surface_features {
+    // What a camera ray saw at its first hit, used to guide the denoiser.
+    colour albedo;              // Base colour of the surface, or the background on a miss
+    vec3   normal;              // Shading normal facing the camera, or zero on a miss
+    double depth = miss_depth;  // Distance along the ray to the hit
+
+    static constexpr double miss_depth = 1e9;  // Depth recorded when the ray escapes the scene
+};
+
+class film {
+  public:
+    // Accumulates raw linear radiance for every pixel. Each pixel keeps the running sum of its
+    // samples, the sum of squared sample luminance and its sample count, which is enough to
+    // recover the mean colour and an estimate of its variance at any time. Films made with
+    // `features` set also accumulate first-hit surface features for the denoiser, counted
+    // separately; without it those buffers are neither allocated, saved nor sent.
+
+    film() : film(0, 0) {}
+
+    film(int width, int height, bool features = false)
+      : image_width(width), image_height(height),
+        sums(size_t(width) * height), luminance_sq_sums(size_t(width) * height, 0.0),
+        counts(size_t(width) * height, 0)
+    {
+        set_features(features);
+    }
+
+    int width() const  { return image_width; }
+    int height() const { return image_height; }
+    bool has_features() const { return !feature_counts.empty(); }
+
+    void set_features(bool enabled) {
+        // Allocates empty feature buffers, or frees them along with what they held.
+        if (enabled == has_features())
+            return;
+        auto n = enabled ? size_t(image_width) * image_height : 0;
+        albedo_sums.assign(n, colour(0,0,0));
+        normal_sums.assign(n, vec3(0,0,0));
+        depth_sums.assign(n, 0.0);
+        feature_counts.assign(n, 0);
+    }
+
+    void add_sample(int i, int j, const colour& sample) {
+        auto index = pixel_index(i, j);
+        auto y = luminance(sample);
+        sums[index] += sample;
+        luminance_sq_sums[index] += y*y;
+        counts[index]++;
+    }
+
+    void add_features(int i, int j, const surface_features& features) {
+        auto index = pixel_index(i, j);
+        albedo_sums[index] += features.albedo;
+        normal_sums[index] += features.normal;
+        depth_sums[index] += features.depth;
+        feature_counts[index]++;
+    }
+
+    int sample_count(int i, int j) const { return counts[pixel_index(i, j)]; }
+
+    colour mean(int i, int j) const {
+        auto index = pixel_index(i, j);
+        if (counts[index] == 0)
+            return colour(0,0,0);
+        return sums[index] / counts[index];
+    }
+
+    surface_features features(int i, int j) const {
+        // Returns the pixel's mean features; the normal is renormalized unless it is zero.
+        auto index = pixel_index(i, j);
+        auto n = has_features() ? feature_counts[index] : 0;
+        if (n == 0)
+            return {colour(0,0,0), vec3(0,0,0), surface_features::miss_depth};
+
+        auto normal = normal_sums[index] / n;
+        if (normal.length_squared() > 1e-12)
+            normal = unit_vector(normal);
+        return {albedo_sums[index] / n, normal, depth_sums[index] / n};
+    }
+
+    std::vector<float> mean_rgb() const {
+        // Returns every pixel's mean colour as packed, row-major RGB floats.
+        std::vector<float> rgb(sums.size() * 3);
+        for (size_t index = 0; index < sums.size(); index++) {
+            auto scale = counts[index] > 0 ? 1.0 / counts[index] : 0.0;
+            rgb[3*index + 0] = float(sums[index].x() * scale);
+            rgb[3*index + 1] = float(sums[index].y() * scale);
+            rgb[3*index + 2] = float(sums[index].z() * scale);
+        }
+        return rgb;
+    }
+
+    double mean_error(int i, int j) const {
+        // Returns the standard error of the pixel's mean luminance.
+        auto index = pixel_index(i, j);
+        auto n = counts[index];
+        if (n < 2)
+            return infinity;
+
+        auto mean_y = luminance(sums[index]) / n;
+        auto variance = (luminance_sq_sums[index] - n * mean_y * mean_y) / (n - 1);
+        return std::sqrt(std::fmax(variance, 0.0) / n);
+    }
+
+    bool converged(int i, int j, double threshold) const {
+        // A pixel has converged once its 95% confidence interval is within `threshold` of its
+        // mean luminance. The small floor stops near-black pixels from never converging.
+        auto mean_y = luminance(mean(i, j));
+        return 1.96 * mean_error(i, j) <= threshold * std::fmax(mean_y, 1e-3);
+    }
+
+    film region(int x0, int y0, int x1, int y1) const {
+        // Returns a copy of the pixels in [x0,x1) x [y0,y1) as a film of its own.
+        film part(x1 - x0, y1 - y0, has_features());
+        for (int j = y0; j < y1; j++) {
+            for (int i = x0; i < x1; i++) {
+                auto from = pixel_index(i, j);
+                auto to = part.pixel_index(i - x0, j - y0);
+                part.sums[to] = sums[from];
+                part.luminance_sq_sums[to] = luminance_sq_sums[from];
+                part.counts[to] = counts[from];
+                if (!has_features())
+                    continue;
+                part.albedo_sums[to] = albedo_sums[from];
+                part.normal_sums[to] = normal_sums[from];
+                part.depth_sums[to] = depth_sums[from];
+                part.feature_counts[to] = feature_counts[from];
+            }
+        }
+        return part;
+    }
+
+    void store_region(const film& part, int x0, int y0) {
+        // Overwrites the pixels covered by `part`, placed with its upper-left corner at x0,y0.
+        // Features are copied only when both films keep them.
+        bool copy_features = has_features() && part.has_features();
+        for (int j = 0; j < part.image_height; j++) {
+            for (int i = 0; i < part.image_width; i++) {
+                auto from = part.pixel_index(i, j);
+                auto to = pixel_index(x0 + i, y0 + j);
+                sums[to] = part.sums[from];
+                luminance_sq_sums[to] = part.luminance_sq_sums[from];
+                counts[to] = part.counts[from];
+                if (!copy_features)
+                    continue;
+                albedo_sums[to] = part.albedo_sums[from];
+                normal_sums[to] = part.normal_sums[from];
+                depth_sums[to] = part.depth_sums[from];
+                feature_counts[to] = part.feature_counts[from];
+            }
+        }
+    }
+
+    bool save(const std::string& path, uint64_t key) const {
+        // Writes the raw accumulation buffers, tagged with `key`, to `path`. The data goes to a
+        // temporary file first so a crash mid-write never clobbers the previous checkpoint.
+        auto temp_path = path + ".tmp";
+        {
+            std::ofstream out(temp_path, std::ios::binary);
+            if (!out)
+                return false;
+
+            out.write(file_magic, sizeof(file_magic));
+            write_value(out, file_version);
+            write_value(out, key);
+            write_pixels(out);
+            if (!out)
+                return false;
+        }
+        return std::rename(temp_path.c_str(), path.c_str()) == 0;
+    }
+
+    bool load(const std::string& path, uint64_t key) {
+        // Replaces this film's contents with the checkpoint at `path`. Returns false, leaving the
+        // film untouched, if the file is missing, malformed, or was written for another key or
+        // image size. The film keeps its own choice of feature buffers: features missing from
+        // the file start empty, and ones this film does not keep are dropped.
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+            return false;
+
+        char magic[sizeof(file_magic)];
+        uint32_t version;
+        uint64_t file_key;
+        in.read(magic, sizeof(magic));
+        read_value(in, version);
+        read_value(in, file_key);
+
+        if (!in || std::memcmp(magic, file_magic, sizeof(magic)) != 0 || version != file_version
+            || file_key != key)
+            return false;
+
+        film loaded;
+        if (!loaded.read_pixels(in, image_width, image_height))
+            return false;
+
+        loaded.set_features(has_features());
+        *this = std::move(loaded);
+        return true;
+    }
+
+    void write_pixels(std::ostream& out) const {
+        // Writes the dimensions, whether feature buffers follow, and the raw accumulation
+        // buffers in native byte order.
+        write_value(out, int32_t(image_width));
+        write_value(out, int32_t(image_height));
+        write_value(out, uint8_t(has_features()));
+        out.write(reinterpret_cast<const char*>(sums.data()), sums.size() * sizeof(colour));
+        out.write(reinterpret_cast<const char*>(luminance_sq_sums.data()),
+                  luminance_sq_sums.size() * sizeof(double));
+        out.write(reinterpret_cast<const char*>(counts.data()), counts.size() * sizeof(int));
+        // The feature buffers are empty, and so write nothing, in films without features.
+        out.write(reinterpret_cast<const char*>(albedo_sums.data()), albedo_sums.size() * sizeof(colour));
+        out.write(reinterpret_cast<const char*>(normal_sums.data()), normal_sums.size() * sizeof(vec3));
+        out.write(reinterpret_cast<const char*>(depth_sums.data()), depth_sums.size() * sizeof(double));
+        out.write(reinterpret_cast<const char*>(feature_counts.data()), feature_counts.size() * sizeof(int));
+    }
+
+    bool read_pixels(std::istream& in, int expected_width, int expected_height) {
+        // Reads buffers written by write_pixels, resizing this film to match. The stream comes
+        // from a file or a peer, so its dimensions are checked against the ones the caller
+        // expects before anything is allocated for them.
+        int32_t width, height;
+        uint8_t features;
+        read_value(in, width);
+        read_value(in, height);
+        read_value(in, features);
+        if (!in || width != expected_width || height != expected_height || features > 1)
+            return false;
+
+        film loaded(width, height, features);
+        in.read(reinterpret_cast<char*>(loaded.sums.data()), loaded.sums.size() * sizeof(colour));
+        in.read(reinterpret_cast<char*>(loaded.luminance_sq_sums.data()),
+                loaded.luminance_sq_sums.size() * sizeof(double));
+        in.read(reinterpret_cast<char*>(loaded.counts.data()), loaded.counts.size() * sizeof(int));
+        in.read(reinterpret_cast<char*>(loaded.albedo_sums.data()), loaded.albedo_sums.size() * sizeof(colour));
+        in.read(reinterpret_cast<char*>(loaded.normal_sums.data()), loaded.normal_sums.size() * sizeof(vec3));
+        in.read(reinterpret_cast<char*>(loaded.depth_sums.data()), loaded.depth_sums.size() * sizeof(double));
+        in.read(reinterpret_cast<char*>(loaded.feature_counts.data()),
+                loaded.feature_counts.size() * sizeof(int));
+        if (!in)
+            return false;
+
+        *this = std::move(loaded);
+        return true;
+    }
+
+    static size_t serialized_size(int width, int height) {
+        // Most bytes write_pixels can produce for a film of this size: the size with features.
+        auto per_pixel = 2 * sizeof(colour) + sizeof(vec3) + 2 * sizeof(double) + 2 * sizeof(int);
+        return 2 * sizeof(int32_t) + sizeof(uint8_t) + size_t(width) * height * per_pixel;
+    }
+
+    double average_samples() const {
+        if (counts.empty())
+            return 0;
+        double total = 0;
+        for (auto n : counts)
+            total += n;
+        return total / counts.size();
+    }
+
+  private:
+    static constexpr char     file_magic[8] = {'R','T','F','I','L','M','\0','\0'};
+    static constexpr uint32_t file_version  = 3;  // 2 added the feature buffers, 3 made them optional
+
+    int image_width;
+    int image_height;
+    std::vector<colour> sums;
+    std::vector<double> luminance_sq_sums;
+    std::vector<int>    counts;
+    std::vector<colour> albedo_sums;
+    std::vector<vec3>   normal_sums;
+    std::vector<double> depth_sums;
+    std::vector<int>    feature_counts;
+
+    size_t pixel_index(int i, int j) const { return size_t(j) * image_width + i; }
+
+    template <typename T>
+    static void write_value(std::ostream& out, const T& value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    static void read_value(std::istream& in, T& value) {
+        in.read(reinterpret_cast<char*>(&value), sizeof(T));
+    }
+};
+
+#endif
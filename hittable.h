@@ -4,13 +4,18 @@
 #include "raytracing.h"
 #include "aabb.h"
 
+#include <atomic>
+
 class material;
 
+// Index of a material in the material_table.
+using material_id = uint32_t;
+
 class hit_record {
   public:
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat;
+    material_id mat;
     double t;
     double u;
     double v;
@@ -25,13 +30,73 @@ class hit_record {
     }
 };
 
+class ray_deferral {
+  public:
+    // Lets geometry that streams from disk decline a ray instead of stalling on I/O. Such
+    // geometry sets pending() when a ray needs data that is not in memory yet, and the camera,
+    // which clears the flag before each sample, drops a sample that set it and retries it
+    // later. While blocking() is set the geometry must load what it needs and answer.
+
+    static bool& pending() {
+        thread_local bool flag = false;
+        return flag;
+    }
+
+    static bool& blocking() {
+        thread_local bool flag = false;
+        return flag;
+    }
+};
+
+class path_sample {
+  public:
+    // Sample values the integrator hands to geometry whose hit() makes a random decision of
+    // its own, such as where a ray scatters inside a medium. The camera sets free_flight()
+    // from the sampler before each bounce is traced, so the decision follows the pixel,
+    // sample and bounce like every other; outside a render it is negative.
+
+    static double& free_flight() {
+        thread_local double value = -1;
+        return value;
+    }
+};
+
 class hittable {
   public:
+    hittable() = default;
+    hittable(const hittable&) {}
+    hittable& operator=(const hittable&) { changed(); return *this; }
     virtual ~hittable() = default;
 
+    uint64_t generation() const {
+        // Unique to this object and its current set of children: no other hittable in the
+        // process has it, and it changes when objects are added or removed. A compiled_scene
+        // uses it to tell whether the graph it came from is still the one it was built from.
+        return generation_number;
+    }
+
   virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
 
+    virtual bool occluded(const ray& r, interval ray_t) const {
+        // Any-hit query for visibility tests: true if anything intersects the ray within ray_t.
+        // Overrides return at the first intersection found and skip the shading data hit()
+        // fills in; this fallback just runs hit().
+        hit_record rec;
+        return hit(r, ray_t, rec);
+    }
+
   virtual aabb bounding_box() const = 0;
+
+  protected:
+    void changed() { generation_number = next_generation(); }
+
+  private:
+    uint64_t generation_number = next_generation();
+
+    static uint64_t next_generation() {
+        static std::atomic<uint64_t> last{0};
+        return ++last;
+    }
 };
 
 class translate : public hittable {
@@ -56,9 +121,20 @@ class translate : public hittable {
         return true;
     }
 
+    bool occluded(const ray& r, interval ray_t) const override {
+        return object->occluded(ray(r.origin() - offset, r.direction(), r.time()), ray_t);
+    }
+
+    void set_offset(const vec3& new_offset) {
+        // Moves the object between frames; the BVH holding it needs an update() afterwards.
+        offset = new_offset;
+        bbox = object->bounding_box() + offset;
+    }
+
     aabb bounding_box() const override { return bbox; }
 
   private:
+    friend class compiled_scene;
     shared_ptr<hittable> object;
     vec3 offset;
     aabb bbox;
@@ -102,19 +178,7 @@ class rotate_y : public hittable {
 
         // Transform the ray from world space to object space.
 
-        auto origin = point3(
-            (cos_theta * r.origin().x()) - (sin_theta * r.origin().z()),
-            r.origin().y(),
-            (sin_theta * r.origin().x()) + (cos_theta * r.origin().z())
-        );
-
-        auto direction = vec3(
-            (cos_theta * r.direction().x()) - (sin_theta * r.direction().z()),
-            r.direction().y(),
-            (sin_theta * r.direction().x()) + (cos_theta * r.direction().z())
-        );
-
-        ray rotated_r(origin, direction, r.time());
+        ray rotated_r = to_object(r);
 
         // Determine whether an intersection exists in object space (and if so, where).
 
@@ -138,13 +202,34 @@ class rotate_y : public hittable {
         return true;
     }
 
+    bool occluded(const ray& r, interval ray_t) const override {
+        return object->occluded(to_object(r), ray_t);
+    }
+
     aabb bounding_box() const override { return bbox; }
     
   private:
+    friend class compiled_scene;
     shared_ptr<hittable> object;
     double sin_theta;
     double cos_theta;
     aabb bbox;
+
+    ray to_object(const ray& r) const {
+        auto origin = point3(
+            (cos_theta * r.origin().x()) - (sin_theta * r.origin().z()),
+            r.origin().y(),
+            (sin_theta * r.origin().x()) + (cos_theta * r.origin().z())
+        );
+
+        auto direction = vec3(
+            (cos_theta * r.direction().x()) - (sin_theta * r.direction().z()),
+            r.direction().y(),
+            (sin_theta * r.direction().x()) + (cos_theta * r.direction().z())
+        );
+
+        return ray(origin, direction, r.time());
+    }
 };
 
 #endif
\ No newline at end of file
@@ -3,20 +3,25 @@
 
 #include "aabb.h"
 #include "hittable.h"
+#include "stats.h"
 
 #include <vector>
 
 class hittable_list : public hittable {
   public:
-    std::vector<shared_ptr<hittable>> objects;
+    std::vector<shared_ptr<hittable>> objects;  // Change only through add() and clear()
 
     hittable_list() {}
     hittable_list(shared_ptr<hittable> object, std::mt19937 rng) { add(object); }
 
-    void clear() { objects.clear(); }
+    void clear() {
+        objects.clear();
+        changed();
+    }
 
     void add(shared_ptr<hittable> object) {
         objects.push_back(object);
+        changed();
         bbox = aabb(bbox, object->bounding_box());
     }
 
@@ -24,6 +29,7 @@ class hittable_list : public hittable {
         hit_record temp_rec;
         bool hit_anything = false;
         auto closest_so_far = ray_t.max;
+        trace_stats::primitive_tests(objects.size());
 
         for (const auto& object : objects) {
             if (object->hit(r, interval(ray_t.min, closest_so_far), temp_rec)) {
@@ -36,6 +42,15 @@ class hittable_list : public hittable {
         return hit_anything;
     }
 
+    bool occluded(const ray& r, interval ray_t) const override {
+        for (const auto& object : objects) {
+            trace_stats::primitive_tests(1);
+            if (object->occluded(r, ray_t))
+                return true;
+        }
+        return false;
+    }
+
     aabb bounding_box() const override {
         return bbox;
     }
@@ -0,0 +1,156 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "raytracing.h"
+
+#include <algorithm>
+#include <vector>
+
+enum class image_format {
+    ppm_ascii,   // P3, one text triple per pixel
+    ppm_binary,  // P6, raw 8-bit RGB
+    png,         // 8-bit RGB PNG
+    pfm          // Portable float map, linear 32-bit float RGB
+};
+
+inline std::vector<unsigned char> tone_map(const std::vector<float>& linear) {
+    // Gamma-corrects and quantizes a whole buffer of linear colour components to bytes in one
+    // pass. The loop body is branch-free so the compiler can vectorize it; fmax also maps NaNs
+    // from bad samples to black.
+    std::vector<unsigned char> bytes(linear.size());
+    const float* in = linear.data();
+    unsigned char* out = bytes.data();
+    for (size_t i = 0; i < linear.size(); i++) {
+        float v = std::fmin(std::sqrt(std::fmax(in[i], 0.0f)), 0.999f);
+        out[i] = static_cast<unsigned char>(256.0f * v);
+    }
+    return bytes;
+}
+
+class png_encoder {
+  public:
+    // Minimal PNG writer: 8-bit RGB, no filtering, and zlib "stored" (uncompressed) deflate
+    // blocks. The files are larger than a compressing encoder's, but every viewer reads them and
+    // encoding runs at memory speed.
+
+    static void write(std::ostream& out, int width, int height, const std::vector<unsigned char>& rgb) {
+        static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        out.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+
+        std::vector<unsigned char> header;
+        put_u32(header, uint32_t(width));
+        put_u32(header, uint32_t(height));
+        header.insert(header.end(), {8, 2, 0, 0, 0});  // 8-bit depth, RGB, deflate, no filter/interlace
+        write_chunk(out, "IHDR", header);
+
+        // Each scanline is prefixed with filter type 0 (none).
+        size_t row_bytes = size_t(width) * 3;
+        std::vector<unsigned char> raw;
+        raw.reserve((row_bytes + 1) * height);
+        for (int j = 0; j < height; j++) {
+            raw.push_back(0);
+            raw.insert(raw.end(), rgb.begin() + j * row_bytes, rgb.begin() + (j + 1) * row_bytes);
+        }
+
+        write_chunk(out, "IDAT", zlib_store(raw));
+        write_chunk(out, "IEND", {});
+    }
+
+  private:
+    static void put_u32(std::vector<unsigned char>& buf, uint32_t v) {
+        buf.push_back((v >> 24) & 0xff);
+        buf.push_back((v >> 16) & 0xff);
+        buf.push_back((v >> 8) & 0xff);
+        buf.push_back(v & 0xff);
+    }
+
+    static uint32_t crc32(uint32_t crc, const unsigned char* data, size_t size) {
+        static const auto table = [] {
+            std::vector<uint32_t> t(256);
+            for (uint32_t n = 0; n < 256; n++) {
+                uint32_t c = n;
+                for (int k = 0; k < 8; k++)
+                    c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                t[n] = c;
+            }
+            return t;
+        }();
+
+        crc = ~crc;
+        for (size_t i = 0; i < size; i++)
+            crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    static std::vector<unsigned char> zlib_store(const std::vector<unsigned char>& data) {
+        std::vector<unsigned char> z = {0x78, 0x01};  // Deflate, 32K window, no preset dictionary
+
+        const size_t max_block = 65535;
+        size_t pos = 0;
+        do {
+            size_t len = std::min(max_block, data.size() - pos);
+            bool final_block = pos + len == data.size();
+            z.push_back(final_block ? 1 : 0);
+            z.push_back(len & 0xff);
+            z.push_back((len >> 8) & 0xff);
+            z.push_back(~len & 0xff);
+            z.push_back((~len >> 8) & 0xff);
+            z.insert(z.end(), data.begin() + pos, data.begin() + pos + len);
+            pos += len;
+        } while (pos < data.size());
+
+        // Adler-32 of the uncompressed data. 5552 is the largest run that cannot overflow.
+        uint32_t a = 1, b = 0;
+        for (size_t i = 0; i < data.size();) {
+            size_t run_end = std::min(data.size(), i + 5552);
+            for (; i < run_end; i++) {
+                a += data[i];
+                b += a;
+            }
+            a %= 65521;
+            b %= 65521;
+        }
+        put_u32(z, (b << 16) | a);
+        return z;
+    }
+
+    static void write_chunk(std::ostream& out, const char type[4], const std::vector<unsigned char>& data) {
+        std::vector<unsigned char> chunk;
+        put_u32(chunk, uint32_t(data.size()));
+        chunk.insert(chunk.end(), type, type + 4);
+        chunk.insert(chunk.end(), data.begin(), data.end());
+        put_u32(chunk, crc32(0, chunk.data() + 4, chunk.size() - 4));
+        out.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+    }
+};
+
+inline void write_image(
+    std::ostream& out, image_format format, int width, int height, const std::vector<float>& linear
+) {
+    // Writes a row-major, top-to-bottom buffer of linear RGB radiance. The 8-bit formats are
+    // gamma-corrected and clamped; PFM keeps the raw linear values for later post-processing.
+    if (format == image_format::pfm) {
+        // PFM stores rows bottom-to-top; a negative scale marks the floats as little-endian,
+        // which assumes a little-endian host.
+        out << "PF\n" << width << ' ' << height << "\n-1.0\n";
+        size_t row_floats = size_t(width) * 3;
+        for (int j = height - 1; j >= 0; j--)
+            out.write(reinterpret_cast<const char*>(linear.data() + j * row_floats), row_floats * sizeof(float));
+        return;
+    }
+
+    auto bytes = tone_map(linear);
+
+    if (format == image_format::png) {
+        png_encoder::write(out, width, height, bytes);
+    } else if (format == image_format::ppm_binary) {
+        out << "P6\n" << width << ' ' << height << "\n255\n";
+        out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    } else {
+        out << "P3\n" << width << ' ' << height << "\n255\n";
+        for (size_t i = 0; i < bytes.size(); i += 3)
+            out << int(bytes[i]) << ' ' << int(bytes[i+1]) << ' ' << int(bytes[i+2]) << '\n';
+    }
+}
+
+#endif
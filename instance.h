@@ -0,0 +1,135 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "hittable.h"
+
+class affine_transform {
+  public:
+    // Maps object space to world space as p -> L p + t, where the columns of the linear part L
+    // are the images of the object's axes. The inverse is kept alongside so rays can be taken
+    // back into object space without solving anything per ray.
+
+    affine_transform() : affine_transform(vec3(1,0,0), vec3(0,1,0), vec3(0,0,1), vec3(0,0,0)) {}
+
+    affine_transform(const vec3& x_axis, const vec3& y_axis, const vec3& z_axis, const vec3& translation)
+      : columns{x_axis, y_axis, z_axis}, offset(translation)
+    {
+        // Rows of L^-1 are the cross products of pairs of columns over the determinant.
+        auto det = dot(x_axis, cross(y_axis, z_axis));
+        inverse_rows[0] = cross(y_axis, z_axis) / det;
+        inverse_rows[1] = cross(z_axis, x_axis) / det;
+        inverse_rows[2] = cross(x_axis, y_axis) / det;
+    }
+
+    static affine_transform translation(const vec3& offset) {
+        return affine_transform(vec3(1,0,0), vec3(0,1,0), vec3(0,0,1), offset);
+    }
+
+    static affine_transform scaling(const vec3& factors) {
+        return affine_transform(vec3(factors.x(),0,0), vec3(0,factors.y(),0), vec3(0,0,factors.z()), vec3(0,0,0));
+    }
+
+    static affine_transform rotation_y(double angle) {
+        // Rotates by `angle` degrees about the y axis, in the same sense as rotate_y.
+        auto radians = degrees_to_radians(angle);
+        auto sin_theta = std::sin(radians);
+        auto cos_theta = std::cos(radians);
+        return affine_transform(vec3(cos_theta, 0, -sin_theta), vec3(0,1,0), vec3(sin_theta, 0, cos_theta), vec3(0,0,0));
+    }
+
+    affine_transform operator*(const affine_transform& inner) const {
+        // The transform that applies `inner` first and then this one.
+        return affine_transform(vector(inner.columns[0]), vector(inner.columns[1]),
+                                vector(inner.columns[2]), point(inner.offset));
+    }
+
+    point3 point(const point3& p) const { return vector(p) + offset; }
+
+    vec3 vector(const vec3& v) const {
+        return v.x() * columns[0] + v.y() * columns[1] + v.z() * columns[2];
+    }
+
+    vec3 normal(const vec3& n) const {
+        // Normals map by the inverse transpose, so they stay perpendicular to surfaces under
+        // non-uniform scaling. The result is not normalized.
+        return n.x() * inverse_rows[0] + n.y() * inverse_rows[1] + n.z() * inverse_rows[2];
+    }
+
+    point3 inverse_point(const point3& p) const { return inverse_vector(p - offset); }
+
+    vec3 inverse_vector(const vec3& v) const {
+        return vec3(dot(inverse_rows[0], v), dot(inverse_rows[1], v), dot(inverse_rows[2], v));
+    }
+
+    aabb bounds(const aabb& box) const {
+        // World bounds of an object-space box: the box around its eight transformed corners.
+        point3 min( infinity,  infinity,  infinity);
+        point3 max(-infinity, -infinity, -infinity);
+
+        for (int i = 0; i < 2; i++) {
+            for (int j = 0; j < 2; j++) {
+                for (int k = 0; k < 2; k++) {
+                    auto corner = point(point3(i ? box.x.max : box.x.min,
+                                               j ? box.y.max : box.y.min,
+                                               k ? box.z.max : box.z.min));
+                    for (int c = 0; c < 3; c++) {
+                        min[c] = std::fmin(min[c], corner[c]);
+                        max[c] = std::fmax(max[c], corner[c]);
+                    }
+                }
+            }
+        }
+
+        return aabb(min, max);
+    }
+
+  private:
+    vec3 columns[3];
+    vec3 offset;
+    vec3 inverse_rows[3];
+};
+
+class instance : public hittable {
+  public:
+    // One placement of a shared bottom-level structure, usually a BVH built once for a shape
+    // or group of shapes. Any number of instances can refer to the same geometry, and a BVH
+    // over the instances makes the top level of a two-level acceleration structure.
+    //
+    // Rays are carried into object space without normalizing their direction, so hit
+    // distances mean the same in both spaces and ray_t needs no conversion.
+
+    instance(shared_ptr<hittable> object, const affine_transform& to_world)
+      : object(object), to_world(to_world)
+    {
+        bbox = to_world.bounds(object->bounding_box());
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        ray object_r(to_world.inverse_point(r.origin()), to_world.inverse_vector(r.direction()), r.time());
+
+        if (!object->hit(object_r, ray_t, rec))
+            return false;
+
+        // The normal already faces the ray, and the inverse transpose preserves its dot
+        // product with the direction, so front_face carries over unchanged.
+        rec.p = to_world.point(rec.p);
+        rec.normal = unit_vector(to_world.normal(rec.normal));
+
+        return true;
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override {
+        ray object_r(to_world.inverse_point(r.origin()), to_world.inverse_vector(r.direction()), r.time());
+        return object->occluded(object_r, ray_t);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+  private:
+    friend class compiled_scene;
+    shared_ptr<hittable> object;
+    affine_transform to_world;
+    aabb bbox;
+};
+
+#endif
@@ -1,14 +1,19 @@
 #include "raytracing.h"
 
-#include "bvh.h"
+#include "wide_bvh.h"
 #include "camera.h"
+#include "cluster.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "instance.h"
+#include "mesh_loader.h"
 #include "shapes.h"
+#include "sphere_set.h"
 #include "material.h"
 #include "texture.h"
 #include "quad.h"
 #include "constant_medium.h"
+#include "out_of_core.h"
 #include <random>
 #include <fstream>
 
@@ -54,7 +59,9 @@ void cornell_smoke(point3 lookfrom = point3(278, 278, -800), point3 lookat = poi
     cam.vup      = vec3(0,1,0);
 
     cam.defocus_angle = 0;
-    std::ofstream out(filename);
+    cam.checkpoint_path = filename + ".checkpoint";
+    cam.scene_tag = "cornell_smoke";
+    std::ofstream out(filename, std::ios::binary);
     cam.render(world, RAND_SEED, out);
 }
 
@@ -87,9 +94,10 @@ void cornell_box(point3 lookfrom = point3(278, 278, -800), point3 lookat = point
 
     cam.aspect_ratio      = 1.0;
     cam.image_width       = 1920;
-    cam.samples_per_pixel = 400;
+    cam.samples_per_pixel = 64;
     cam.max_depth         = 200;
     cam.background        = colour(0,0,0);
+    cam.denoise           = true;
 
     cam.vfov     = 40;
     cam.lookfrom = lookfrom;
@@ -97,14 +105,14 @@ void cornell_box(point3 lookfrom = point3(278, 278, -800), point3 lookat = point
     cam.vup      = vec3(0,1,0);
 
     cam.defocus_angle = 0;
-    std::ofstream out(filename);
+    std::ofstream out(filename, std::ios::binary);
     cam.render(world, RAND_SEED, out);
 }
 
 
 void simple_light(point3 lookfrom = point3(26,3,6), point3 lookat = point3(0,2,0), const std::string&filename = "output.ppm") {
     hittable_list world;
-    std::ofstream out(filename);
+    std::ofstream out(filename, std::ios::binary);
     auto pertext = make_shared<noise_texture>(4);
     world.add(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(pertext)));
     world.add(make_shared<sphere>(point3(0,2,0), 2, make_shared<lambertian>(pertext)));
@@ -149,7 +157,7 @@ void earth(point3 lookfrom = point3(13,3,3), point3 lookat = point3(0,0,0), cons
     cam.vup      = vec3(0,1,0);
 
     cam.defocus_angle = 0;
-    std::ofstream out(filename);
+    std::ofstream out(filename, std::ios::binary);
     cam.render(hittable_list(globe, std::mt19937(RAND_SEED)), RAND_SEED, out);
 }
 
@@ -199,23 +207,24 @@ void perlin_spheres(unsigned int seed = RAND_SEED, point3 lookfrom = point3(13,3
     cam.vup      = vec3(0,1,0);
 
     cam.defocus_angle = 0;
-    std::ofstream out(filename);
+    std::ofstream out(filename, std::ios::binary);
     cam.render(world, seed, out);
 }
 
-int bouncing_spheres_image_generation(unsigned int seed = RAND_SEED, point3 lookfrom = point3(13,3,3), point3 lookat = point3(0,1,0), const std::string& filename = "output.ppm") {
-    std::ofstream out(filename);
-    if (!out) {
-        std::cerr << "Failed to open " << filename << " for writing.\n";
-        return 1;
-    }
-
-    std::mt19937 rng(seed);
+point3 camera_sphere_center(point3 lookfrom, point3 lookat) {
+    return point3(lookfrom.x() + (lookfrom.x() - lookat.x()) * 0.5,
+                  lookfrom.y() + (lookfrom.y() - lookat.y()) * 0.5,
+                  lookfrom.z() + (lookfrom.z() - lookat.z()) * 0.5);
+}
 
+shared_ptr<bvh4> bouncing_spheres_world(std::mt19937& rng, point3 lookfrom, point3 lookat, shared_ptr<sphere>& camera_sphere) {
     hittable_list world;
     auto checker = make_shared<checker_texture>(0.32, colour(.2, .3, .1), colour(.9, .9, .9));
     world.add(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(checker)));
 
+    // The small spheres go into one packed set; the large ones stay separate objects.
+    auto small_spheres = make_shared<sphere_set>();
+
     for (int a = -11; a < 11; a++) {
         for (int b = -11; b < 11; b++) {
             auto choose_mat = random_double(rng);
@@ -229,7 +238,7 @@ int bouncing_spheres_image_generation(unsigned int seed = RAND_SEED, point3 look
                     auto albedo = colour::random(rng) * colour::random(rng);
                     material = make_shared<lambertian>(albedo);
                     auto center2 = center + vec3(0, random_double(0.0, 0.5, rng), 0);
-                    world.add(make_shared<sphere>(center, center2, 0.2, material));
+                    small_spheres->add(center, center2, 0.2, material);
                     continue;
                 } else if (choose_mat < 0.9) {
                     // metal
@@ -241,10 +250,12 @@ int bouncing_spheres_image_generation(unsigned int seed = RAND_SEED, point3 look
                     // glass
                     material = make_shared<dielectric>(1.5);
                 }
-                world.add(make_shared<sphere>(center, 0.2, material));
+                small_spheres->add(center, 0.2, material);
             }
         }
     }
+    small_spheres->build();
+    world.add(small_spheres);
 
     auto material1 = make_shared<dielectric>(1.5);
     world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material1));
@@ -258,15 +269,14 @@ int bouncing_spheres_image_generation(unsigned int seed = RAND_SEED, point3 look
     // Add a green metal sphere just behind the camera, this makes the "camera"
     // appear in reflections.
 
-    point3 green_sphere_center(lookfrom.x() + (lookfrom.x() - lookat.x()) * 0.5,
-                               lookfrom.y() + (lookfrom.y() - lookat.y()) * 0.5,
-                               lookfrom.z() + (lookfrom.z() - lookat.z()) * 0.5);
-
     auto material4 = make_shared<metal>(colour(0, 1, 0), 0);
-    world.add(make_shared<sphere>(green_sphere_center, 0.25, material4));
+    camera_sphere = make_shared<sphere>(camera_sphere_center(lookfrom, lookat), 0.25, material4);
+    world.add(camera_sphere);
 
-    world = hittable_list(make_shared<bvh_node>(world), rng);
+    return make_shared<bvh4>(world);
+}
 
+render_status render_bouncing_spheres(const hittable& world, unsigned int seed, point3 lookfrom, point3 lookat, std::ostream& out) {
     camera cam;
 
     cam.aspect_ratio      = 16.0 / 9.0;
@@ -283,13 +293,40 @@ int bouncing_spheres_image_generation(unsigned int seed = RAND_SEED, point3 look
     cam.defocus_angle = 0.6;
     cam.focus_dist    = 10.0;
 
-    cam.render(world, seed, out);
+    return cam.render(world, seed, out);
+}
+
+int bouncing_spheres_image_generation(unsigned int seed = RAND_SEED, point3 lookfrom = point3(13,3,3), point3 lookat = point3(0,1,0), const std::string& filename = "output.ppm") {
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        std::cerr << "Failed to open " << filename << " for writing.\n";
+        return 1;
+    }
+
+    std::mt19937 rng(seed);
+    shared_ptr<sphere> camera_sphere;
+    auto world = bouncing_spheres_world(rng, lookfrom, lookat, camera_sphere);
+
+    render_bouncing_spheres(hittable_list(world, rng), seed, lookfrom, lookat, out);
     return 0;
 }
 
 void video_generation() {
     std::vector<std::string> png_frames;
 
+    // The scene is built once. Only the green sphere following the camera moves, so each frame
+    // just refits the BVH around its new position.
+    std::mt19937 rng(42);
+    shared_ptr<sphere> camera_sphere;
+    auto world = bouncing_spheres_world(rng, point3(13,3,3), point3(0,1,0), camera_sphere);
+
+    auto render_frame = [&](point3 lookfrom, point3 lookat, const char* filename) {
+        camera_sphere->move_to(camera_sphere_center(lookfrom, lookat));
+        world->update();
+        std::ofstream out(filename, std::ios::binary);
+        return render_bouncing_spheres(hittable_list(world, rng), 42, lookfrom, lookat, out);
+    };
+
     int frame_idx = 0;
     // Rotate around the scene
     for (int i = 0; i < 360; i += 3) {
@@ -299,7 +336,9 @@ void video_generation() {
         char ppm_name[64]; char png_name[64];
         std::sprintf(ppm_name, "generation/frame_%04d.ppm", frame_idx);
         std::sprintf(png_name, "generation/frame_%04d.png", frame_idx);
-        // image_generation(42, lookfrom, lookat, ppm_name);
+        // A cluster worker has no frames of its own to convert.
+        if (render_frame(lookfrom, lookat, ppm_name) != render_status::rendered)
+            return;
 
         std::string cmd = "convert " + std::string(ppm_name) + " " + png_name;
         std::system(cmd.c_str());
@@ -324,7 +363,8 @@ void video_generation() {
         char ppm_name[64]; char png_name[64];
         std::sprintf(ppm_name, "generation/frame_%04d.ppm", frame_idx);
         std::sprintf(png_name, "generation/frame_%04d.png", frame_idx);
-        // image_generation(42, lookfrom, lookat, ppm_name);
+        if (render_frame(lookfrom, lookat, ppm_name) != render_status::rendered)
+            return;
 
         std::string cmd = "convert " + std::string(ppm_name) + " " + png_name;
         std::system(cmd.c_str());
@@ -346,7 +386,8 @@ void video_generation() {
         char ppm_name[64]; char png_name[64];
         std::sprintf(ppm_name, "generation/frame_%04d.ppm", frame_idx);
         std::sprintf(png_name, "generation/frame_%04d.png", frame_idx);
-        // image_generation(42, lookfrom, lookat, ppm_name);
+        if (render_frame(lookfrom, lookat, ppm_name) != render_status::rendered)
+            return;
 
         std::string cmd = "convert " + std::string(ppm_name) + " " + png_name;
         std::system(cmd.c_str());
@@ -360,7 +401,7 @@ void video_generation() {
 }
 
 void checkered_spheres(unsigned int seed = RAND_SEED, point3 lookfrom = point3(13,3,3), point3 lookat = point3(0,1,0), const std::string& filename = "output.ppm") {
-    std::ofstream out(filename);
+    std::ofstream out(filename, std::ios::binary);
 
     hittable_list world;
 
@@ -389,7 +430,7 @@ void checkered_spheres(unsigned int seed = RAND_SEED, point3 lookfrom = point3(1
 
 void quads(const std::string& filename = "output.ppm") {
     hittable_list world;
-    std::ofstream out(filename);
+    std::ofstream out(filename, std::ios::binary);
     // Materials
     auto left_red     = make_shared<lambertian>(colour(1.0, 0.2, 0.2));
     auto back_green   = make_shared<lambertian>(colour(0.2, 1.0, 0.2));
@@ -426,6 +467,9 @@ void final_scene(point3 lookfrom = point3(478, 278, -600), point3 lookat = point
     hittable_list boxes1;
     auto ground = make_shared<lambertian>(colour(0.48, 0.83, 0.53));
 
+    // Every ground box is an instance of one shared unit cube, stretched into place.
+    auto unit_box = make_shared<bvh4>(*box(point3(0,0,0), point3(1,1,1), ground));
+
     int boxes_per_side = 20;
     for (int i = 0; i < boxes_per_side; i++) {
         for (int j = 0; j < boxes_per_side; j++) {
@@ -437,13 +481,15 @@ void final_scene(point3 lookfrom = point3(478, 278, -600), point3 lookat = point
             auto y1 = random_double(1,101);
             auto z1 = z0 + w;
 
-            boxes1.add(box(point3(x0,y0,z0), point3(x1,y1,z1), ground));
+            auto placement = affine_transform::translation(vec3(x0,y0,z0))
+                           * affine_transform::scaling(vec3(x1-x0, y1-y0, z1-z0));
+            boxes1.add(make_shared<instance>(unit_box, placement));
         }
     }
 
     hittable_list world;
 
-    world.add(make_shared<bvh_node>(boxes1));
+    world.add(make_shared<bvh4>(boxes1));
 
     auto light = make_shared<diffuse_light>(colour(7, 7, 7));
     world.add(make_shared<quad>(point3(123,554,147), vec3(300,0,0), vec3(0,0,265), light));
@@ -469,19 +515,18 @@ void final_scene(point3 lookfrom = point3(478, 278, -600), point3 lookat = point
     auto pertext = make_shared<noise_texture>(0.2);
     world.add(make_shared<sphere>(point3(220,280,300), 80, make_shared<lambertian>(pertext)));
 
-    hittable_list boxes2;
+    auto boxes2 = make_shared<sphere_set>();
     auto white = make_shared<lambertian>(colour(.73, .73, .73));
     int ns = 1000;
     for (int j = 0; j < ns; j++) {
-        boxes2.add(make_shared<sphere>(point3::random(0,165), 10, white));
+        boxes2->add(point3::random(0,165), 10, white);
     }
+    boxes2->build();
 
-    world.add(make_shared<translate>(
-        make_shared<rotate_y>(
-            make_shared<bvh_node>(boxes2), 15),
-            vec3(-100,270,395)
-        )
-    );
+    world.add(make_shared<instance>(
+        boxes2,
+        affine_transform::translation(vec3(-100,270,395)) * affine_transform::rotation_y(15)
+    ));
 
     camera cam;
 
@@ -497,11 +542,111 @@ void final_scene(point3 lookfrom = point3(478, 278, -600), point3 lookat = point
     cam.vup      = vec3(0,1,0);
 
     cam.defocus_angle = 0;
-    std::ofstream out(filename);
+
+    // Only written by builds configured with -DRT_STATS=ON.
+    cam.cost_heatmap_path = filename.substr(0, filename.rfind('.')) + "_cost.ppm";
+
+    std::ofstream out(filename, std::ios::binary);
     cam.render(world, RAND_SEED, out);
 }
 
-int main() {
+void mesh_scene(const std::string& mesh_path = "models/bunny.ply", const std::string& filename = "output.ppm") {
+    // Any OBJ or PLY model on a ground plane, with the camera framed around its bounds.
+    mesh_data mesh;
+    if (!load_mesh(mesh_path, mesh))
+        return;
+    auto model = make_shared<triangle_mesh>(std::move(mesh), make_shared<lambertian>(colour(0.73, 0.73, 0.73)));
+    std::clog << "Loaded " << model->triangle_count() << " triangles.\n";
+
+    auto box = model->bounding_box();
+    auto center = point3(box.x.min + box.x.max, box.y.min + box.y.max, box.z.min + box.z.max) / 2;
+    auto size = std::fmax(box.x.size(), std::fmax(box.y.size(), box.z.size()));
+
+    hittable_list world;
+    world.add(model);
+    world.add(make_shared<quad>(point3(center.x() - 5*size, box.y.min, center.z() - 5*size),
+                                vec3(10*size, 0, 0), vec3(0, 0, 10*size),
+                                make_shared<lambertian>(colour(0.48, 0.83, 0.53))));
+
+    camera cam;
+
+    cam.aspect_ratio      = 16.0 / 9.0;
+    cam.image_width       = 800;
+    cam.samples_per_pixel = 100;
+    cam.max_depth         = 20;
+    cam.background        = colour(0.70, 0.80, 1.00);
+
+    cam.vfov     = 30;
+    cam.lookfrom = center + size * vec3(1.2, 0.8, 2.0);
+    cam.lookat   = center;
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
+
+    std::ofstream out(filename, std::ios::binary);
+    cam.render(world, RAND_SEED, out);
+}
+
+void streamed_city(const std::string& geometry_path = "city.geom", const std::string& filename = "output.ppm") {
+    // A city of sphere towers, a few million spheres in all, rendered from a chunk file through
+    // a cache much smaller than the file. The file is generated once (and again if an older
+    // version is found), a block at a time, so each chunk covers a compact patch of the city.
+    if (!geometry_file_current(geometry_path)) {
+        chunked_geometry_writer writer(geometry_path);
+        for (int block_x = -40; block_x < 40; block_x++) {
+            for (int block_z = -40; block_z < 40; block_z++) {
+                for (int tower = 0; tower < 16; tower++) {
+                    auto base = point3(block_x * 10 + random_double(0,8), 0, block_z * 10 + random_double(0,8));
+                    auto floors = int(10 + 60 * random_double() * random_double());
+                    auto material = uint32_t(random_double(0,3));
+                    for (int floor = 0; floor < floors; floor++)
+                        writer.add_sphere(base + vec3(0, 0.5 + floor, 0), 0.5, material);
+                }
+            }
+        }
+        if (!writer.finish()) {
+            std::cerr << "ERROR: Could not write geometry file '" << geometry_path << "'.\n";
+            return;
+        }
+    }
+
+    std::vector<shared_ptr<material>> palette = {
+        make_shared<lambertian>(colour(0.65, 0.62, 0.58)),
+        make_shared<lambertian>(colour(0.35, 0.40, 0.48)),
+        make_shared<metal>(colour(0.8, 0.85, 0.9), 0.1),
+    };
+    auto city = make_shared<streamed_geometry>(geometry_path, palette, size_t(64) << 20);
+
+    hittable_list world;
+    world.add(make_shared<sphere>(point3(0,-100000,0), 100000, make_shared<lambertian>(colour(0.3, 0.3, 0.3))));
+    world.add(city);
+
+    camera cam;
+
+    cam.aspect_ratio      = 16.0 / 9.0;
+    cam.image_width       = 800;
+    cam.samples_per_pixel = 64;
+    cam.max_depth         = 8;
+    cam.background        = colour(0.70, 0.80, 1.00);
+
+    cam.vfov     = 35;
+    cam.lookfrom = point3(-420, 160, -420);
+    cam.lookat   = point3(0, 0, 0);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
+
+    std::ofstream out(filename, std::ios::binary);
+    if (cam.render(world, RAND_SEED, out) == render_status::rendered)
+        city->report_cache();
+}
+
+int main(int argc, char* argv[]) {
+    if (!parse_cluster_arguments(argc, argv)) {
+        std::cerr << "Usage: raytracing [--coordinator N] [--port P] [--worker HOST:PORT] [--threads T]\n";
+        return 1;
+    }
+
     switch (11) {
         case 1:  
             bouncing_spheres_image_generation();
@@ -536,6 +681,12 @@ int main() {
         case 11:
             final_scene();
             break;
+        case 12:
+            streamed_city();
+            break;
+        case 13:
+            mesh_scene();
+            break;
     }
     return 0;
 }
@@ -2,15 +2,20 @@
 #define MATERIAL_H
 
 #include "hittable.h"
+#include "onb.h"
+#include "sampler.h"
 #include "texture.h"
+#include <memory>
+#include <mutex>
 #include <random>
+#include <unordered_map>
 
 class material {
   public:
     virtual ~material() = default;
 
     virtual bool scatter(
-        const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered, std::mt19937& rng
+        const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered, sampler& smp
     ) const {
         return false;
     }
@@ -18,6 +23,123 @@ class material {
     virtual colour emitted(double u, double v, const point3& p) const {
         return colour(0,0,0);
     }
+
+    virtual colour base_colour(const hit_record& rec) const {
+        // Surface colour seen by the denoiser's albedo buffer.
+        return colour(1,1,1);
+    }
+};
+
+class material_table {
+  public:
+    // Holds every material that primitives refer to, and numbers them so that hit records
+    // carry a 32-bit id instead of a shared_ptr. Copying a shared_ptr for each candidate hit is
+    // an atomic reference count update on a cache line every thread shares; looking an id up
+    // is a plain read. Primitives register their material through a material_handle, and
+    // registering the same material again returns the id it already has. A material is
+    // released, and its id reused, once the last handle to it is gone.
+
+    static const material& get(material_id id) {
+        // Chunks never move once allocated, so readers need no lock: an id only reaches a
+        // render thread after the add() that gave it out has returned, and is not released
+        // while a primitive that can report it still exists.
+        return *instance().chunks[id / chunk_size][id % chunk_size];
+    }
+
+  private:
+    friend class material_handle;
+
+    static constexpr size_t chunk_size = 1024;
+    static constexpr size_t max_chunks = 4096;  // Room for four million materials
+
+    std::unique_ptr<const material*[]> chunks[max_chunks];
+    std::vector<shared_ptr<material>> owned;  // By id; null for free ids
+    std::vector<uint32_t> holds;              // Handles on each id
+    std::vector<material_id> free_ids;
+    std::unordered_map<const material*, material_id> ids;
+    std::mutex mutex;
+
+    static material_table& instance() {
+        static material_table table;
+        return table;
+    }
+
+    static material_id add(shared_ptr<material> mat) {
+        auto& table = instance();
+        std::lock_guard<std::mutex> lock(table.mutex);
+        auto found = table.ids.find(mat.get());
+        if (found != table.ids.end()) {
+            table.holds[found->second]++;
+            return found->second;
+        }
+
+        material_id id;
+        if (!table.free_ids.empty()) {
+            id = table.free_ids.back();
+            table.free_ids.pop_back();
+        } else {
+            if (table.owned.size() >= chunk_size * max_chunks) {
+                std::cerr << "ERROR: More than " << chunk_size * max_chunks << " materials are in use.\n";
+                std::abort();
+            }
+            id = material_id(table.owned.size());
+            table.owned.emplace_back();
+            table.holds.push_back(0);
+        }
+
+        auto& chunk = table.chunks[id / chunk_size];
+        if (!chunk)
+            chunk = std::make_unique<const material*[]>(chunk_size);
+        chunk[id % chunk_size] = mat.get();
+        table.ids[mat.get()] = id;
+        table.holds[id] = 1;
+        table.owned[id] = std::move(mat);
+        return id;
+    }
+
+    static void retain(material_id id) {
+        auto& table = instance();
+        std::lock_guard<std::mutex> lock(table.mutex);
+        table.holds[id]++;
+    }
+
+    static void release(material_id id) {
+        auto& table = instance();
+        shared_ptr<material> dropped;  // Destroyed after the lock is released
+        std::lock_guard<std::mutex> lock(table.mutex);
+        if (--table.holds[id] > 0)
+            return;
+        table.ids.erase(table.owned[id].get());
+        table.chunks[id / chunk_size][id % chunk_size] = nullptr;
+        dropped = std::move(table.owned[id]);
+        table.free_ids.push_back(id);
+    }
+};
+
+class material_handle {
+  public:
+    // A primitive's registration of its material in the material_table. The id stays valid,
+    // and the material alive, while any handle to it exists.
+
+    explicit material_handle(shared_ptr<material> mat) : handle_id(material_table::add(std::move(mat))) {}
+
+    material_handle(const material_handle& other) : handle_id(other.handle_id) {
+        material_table::retain(handle_id);
+    }
+
+    material_handle& operator=(const material_handle& other) {
+        material_table::retain(other.handle_id);
+        material_table::release(handle_id);
+        handle_id = other.handle_id;
+        return *this;
+    }
+
+    ~material_handle() { material_table::release(handle_id); }
+
+    material_id id() const { return handle_id; }
+
+  private:
+    material_id handle_id;
 };
 
 class lambertian : public material {
@@ -25,19 +147,20 @@ class lambertian : public material {
     lambertian(const colour& albedo) : tex(make_shared<solid_colour>(albedo)) {}
     lambertian(shared_ptr<texture> tex) : tex(tex) {}
 
-    bool scatter(const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered, std::mt19937& rng)
+    bool scatter(const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered, sampler& smp)
     const override {
-        auto scatter_direction = rec.normal + random_unit_vector(rng);
-
-        // Catch degenerate scatter direction
-        if (scatter_direction.near_zero())
-            scatter_direction = rec.normal;
+        onb uvw(rec.normal);
+        auto scatter_direction = uvw.transform(sample_cosine_hemisphere(smp.get_2d()));
 
         scattered = ray(rec.p, scatter_direction, r_in.time());
         attenuation = tex->value(rec.u, rec.v, rec.p);
         return true;
     }
 
+    colour base_colour(const hit_record& rec) const override {
+        return tex->value(rec.u, rec.v, rec.p);
+    }
+
   private:
     shared_ptr<texture> tex;
 };
@@ -45,15 +168,19 @@ class lambertian : public material {
 class metal : public material {
   public:
     metal(const colour& albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
-    bool scatter(const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered, std::mt19937& rng)
+    bool scatter(const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered, sampler& smp)
     const override {
         vec3 reflected = reflect(r_in.direction(), rec.normal);
-        reflected = unit_vector(reflected) + (fuzz * random_unit_vector(rng));
+        reflected = unit_vector(reflected) + (fuzz * sample_uniform_sphere(smp.get_2d()));
         scattered = ray(rec.p, reflected, r_in.time());
         attenuation = albedo;
         return (dot(scattered.direction(), rec.normal) > 0);
     }
 
+    colour base_colour(const hit_record& rec) const override {
+        return albedo;
+    }
+
   private:
     colour albedo;
     double fuzz;
@@ -63,7 +190,7 @@ class dielectric : public material {
   public:
     dielectric(double refraction_index) : refraction_index(refraction_index) {}
 
-    bool scatter(const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered, std::mt19937& rng)
+    bool scatter(const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered, sampler& smp)
     const override {
         attenuation = colour(1.0, 1.0, 1.0);
         double ri = rec.front_face ? (1.0/refraction_index) : refraction_index;
@@ -75,7 +202,7 @@ class dielectric : public material {
         bool cannot_refract = ri * sin_theta > 1.0;
         vec3 direction;
 
-        if (cannot_refract || reflectance(cos_theta, ri) > random_double(rng)) 
+        if (cannot_refract || reflectance(cos_theta, ri) > smp.get_1d()) 
             direction = reflect(unit_direction, rec.normal);
         else
             direction = refract(unit_direction, rec.normal, ri);
@@ -111,13 +238,17 @@ class isotropic : public material {
     isotropic(const colour& albedo) : tex(make_shared<solid_colour>(albedo)) {}
     isotropic(shared_ptr<texture> tex) : tex(tex) {}
 
-    bool scatter(const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered, std::mt19937& rng)
+    bool scatter(const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered, sampler& smp)
     const override {
-        scattered = ray(rec.p, random_unit_vector(), r_in.time());
+        scattered = ray(rec.p, sample_uniform_sphere(smp.get_2d()), r_in.time());
         attenuation = tex->value(rec.u, rec.v, rec.p);
         return true;
     }
 
+    colour base_colour(const hit_record& rec) const override {
+        return tex->value(rec.u, rec.v, rec.p);
+    }
+
   private:
     shared_ptr<texture> tex;
 };
@@ -0,0 +1,266 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include "bvh.h"
+#include "material.h"
+
+struct mesh_data {
+    // Shared vertex attributes in structure-of-arrays form, plus three vertex indices per
+    // triangle. Normals and UVs are optional: leave them empty, or give one per vertex.
+    std::vector<float>    x, y, z;     // Vertex positions
+    std::vector<float>    nx, ny, nz;  // Vertex normals
+    std::vector<float>    u, v;        // Vertex texture coordinates
+    std::vector<uint32_t> indices;
+
+    size_t vertex_count() const { return x.size(); }
+    size_t triangle_count() const { return indices.size() / 3; }
+    bool has_normals() const { return !nx.empty(); }
+    bool has_uvs() const { return !u.empty(); }
+
+    void add_vertex(float px, float py, float pz) {
+        x.push_back(px);
+        y.push_back(py);
+        z.push_back(pz);
+    }
+
+    void add_triangle(uint32_t a, uint32_t b, uint32_t c) {
+        indices.push_back(a);
+        indices.push_back(b);
+        indices.push_back(c);
+    }
+
+    point3 position(uint32_t i) const { return point3(x[i], y[i], z[i]); }
+};
+
+class triangle_mesh : public hittable {
+  public:
+    // Every triangle of a mesh as a single hittable. The mesh builds its own BVH over triangle
+    // indices, so a million triangles cost a million 32-bit references rather than a million
+    // heap objects, and then gathers the corner positions into leaf order so that a leaf's
+    // triangles are tested from contiguous memory.
+    //
+    // The intersector is the watertight one of Woop, Benthin and Wald (JCGT 2013): the ray is
+    // sheared so it runs along +z, and hits are decided by 2D edge functions that triangles
+    // sharing an edge evaluate from the same vertex values. A ray through a shared edge or
+    // vertex therefore hits at least one of the triangles meeting there, never slipping
+    // through the crack that an edge-vector test can leave.
+
+    triangle_mesh(mesh_data mesh, shared_ptr<material> mat, const bvh_build_options& options = {})
+      : mesh(std::move(mesh)), mat(mat)
+    {
+        auto count = this->mesh.triangle_count();
+        std::vector<bvh_primitive> prims(count);
+        for (size_t t = 0; t < count; t++) {
+            auto box = aabb(aabb(corner(t, 0), corner(t, 1)), aabb(corner(t, 2), corner(t, 2)));
+            prims[t] = {box, box.centroid(), t};
+        }
+
+        linear_bvh tree(std::move(prims), options);
+        nodes = std::move(tree.nodes);
+        bbox = tree.bounds;
+
+        // Leaves index slots of primitive_order, so storing triangles in that order lets a
+        // leaf address them directly. SBVH builds may list a triangle in several leaves.
+        std::vector<uint32_t> ordered;
+        ordered.reserve(3 * tree.primitive_order.size());
+        for (auto t : tree.primitive_order) {
+            for (int k = 0; k < 3; k++) {
+                auto p = corner(t, k);
+                for (int axis = 0; axis < 3; axis++)
+                    corners[k][axis].push_back(float(p[axis]));
+                ordered.push_back(this->mesh.indices[3*t + k]);
+            }
+        }
+        this->mesh.indices = std::move(ordered);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (nodes.empty())
+            return false;
+
+        sheared_ray sr(r);
+        vec3 inv_dir(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+        bool dir_is_neg[3] = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
+
+        uint32_t closest = 0;
+        double b1 = 0, b2 = 0;
+        bool hit_anything = false;
+
+        uint32_t stack[linear_bvh::max_depth];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while (stack_size > 0) {
+            auto current = stack[--stack_size];
+            const auto& node = nodes[current];
+            trace_stats::node_visit(1);
+            if (!linear_bvh::node_hit(node, r.origin(), inv_dir, ray_t))
+                continue;
+
+            if (node.count == 0) {
+                // Push the farther child first, so the nearer one is visited next.
+                bool right_first = dir_is_neg[node.axis];
+                stack[stack_size++] = right_first ? current + 1 : node.offset;
+                stack[stack_size++] = right_first ? node.offset : current + 1;
+                continue;
+            }
+
+            trace_stats::primitive_tests(node.count);
+            for (uint32_t slot = node.offset; slot < node.offset + node.count; slot++) {
+                double t, s1, s2;
+                if (intersect(sr, slot, ray_t, t, s1, s2)) {
+                    hit_anything = true;
+                    ray_t.max = t;
+                    closest = slot;
+                    b1 = s1;
+                    b2 = s2;
+                }
+            }
+        }
+
+        if (!hit_anything)
+            return false;
+
+        rec.t = ray_t.max;
+        rec.p = r.at(rec.t);
+        fill_surface(r, closest, b1, b2, rec);
+        return true;
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override {
+        if (nodes.empty())
+            return false;
+
+        sheared_ray sr(r);
+        vec3 inv_dir(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+
+        uint32_t stack[linear_bvh::max_depth];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while (stack_size > 0) {
+            auto current = stack[--stack_size];
+            const auto& node = nodes[current];
+            trace_stats::node_visit(1);
+            if (!linear_bvh::node_hit(node, r.origin(), inv_dir, ray_t))
+                continue;
+
+            if (node.count == 0) {
+                stack[stack_size++] = node.offset;
+                stack[stack_size++] = current + 1;
+                continue;
+            }
+
+            trace_stats::primitive_tests(node.count);
+            for (uint32_t slot = node.offset; slot < node.offset + node.count; slot++) {
+                double t, s1, s2;
+                if (intersect(sr, slot, ray_t, t, s1, s2))
+                    return true;
+            }
+        }
+
+        return false;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t triangle_count() const { return corners[0][0].size(); }
+
+  private:
+    mesh_data mesh;                          // Attributes, with indices in leaf order
+    std::vector<float> corners[3][3];        // corners[k][axis][slot]: leaf-ordered positions
+    std::vector<linear_bvh_node> nodes;
+    material_handle mat;
+    aabb bbox;
+
+    struct sheared_ray {
+        // Per-ray setup for the watertight test: the dominant direction axis becomes z, and
+        // the shear that maps the direction onto +z.
+        point3 origin;
+        int kx, ky, kz;
+        double sx, sy, sz;
+
+        sheared_ray(const ray& r) : origin(r.origin()) {
+            const auto& d = r.direction();
+            kz = std::fabs(d.x()) > std::fabs(d.y())
+               ? (std::fabs(d.x()) > std::fabs(d.z()) ? 0 : 2)
+               : (std::fabs(d.y()) > std::fabs(d.z()) ? 1 : 2);
+            kx = (kz + 1) % 3;
+            ky = (kx + 1) % 3;
+            sx = d[kx] / d[kz];
+            sy = d[ky] / d[kz];
+            sz = 1.0 / d[kz];
+        }
+    };
+
+    point3 corner(size_t triangle, int k) const { return mesh.position(mesh.indices[3*triangle + k]); }
+
+    bool intersect(const sheared_ray& r, uint32_t slot, const interval& ray_t, double& t, double& b1, double& b2) const {
+        // Corners relative to the ray origin, permuted so the ray runs along z.
+        double a[3], b[3], c[3];
+        for (int axis = 0; axis < 3; axis++) {
+            a[axis] = corners[0][axis][slot] - r.origin[axis];
+            b[axis] = corners[1][axis][slot] - r.origin[axis];
+            c[axis] = corners[2][axis][slot] - r.origin[axis];
+        }
+
+        // The sheared 2D corners are rounded to float, so the products below are exact in
+        // double and each edge function has exactly the sign of its true value. Triangles
+        // sharing an edge round its corners identically, so they can never both reject a ray
+        // through it.
+        double ax = float(a[r.kx] - r.sx * a[r.kz]), ay = float(a[r.ky] - r.sy * a[r.kz]);
+        double bx = float(b[r.kx] - r.sx * b[r.kz]), by = float(b[r.ky] - r.sy * b[r.kz]);
+        double cx = float(c[r.kx] - r.sx * c[r.kz]), cy = float(c[r.ky] - r.sy * c[r.kz]);
+
+        // Scaled barycentrics as edge functions. The ray passes through the triangle when they
+        // share a sign; zeros on an edge count for both triangles that share it.
+        double e0 = cx * by - cy * bx;
+        double e1 = ax * cy - ay * cx;
+        double e2 = bx * ay - by * ax;
+        if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0))
+            return false;
+
+        double det = e0 + e1 + e2;
+        if (det == 0)
+            return false;
+
+        double scaled_t = e0 * r.sz * a[r.kz] + e1 * r.sz * b[r.kz] + e2 * r.sz * c[r.kz];
+        t = scaled_t / det;
+        if (!ray_t.surrounds(t))
+            return false;
+
+        b1 = e1 / det;
+        b2 = e2 / det;
+        return true;
+    }
+
+    void fill_surface(const ray& r, uint32_t slot, double b1, double b2, hit_record& rec) const {
+        double b0 = 1 - b1 - b2;
+        auto i0 = mesh.indices[3*slot], i1 = mesh.indices[3*slot + 1], i2 = mesh.indices[3*slot + 2];
+
+        auto p0 = mesh.position(i0);
+        auto geometric = unit_vector(cross(mesh.position(i1) - p0, mesh.position(i2) - p0));
+        rec.set_face_normal(r, geometric);
+
+        if (mesh.has_normals()) {
+            // Smooth shading: the interpolated normal, turned to the side the ray arrived on.
+            auto shading = unit_vector(
+                b0 * vec3(mesh.nx[i0], mesh.ny[i0], mesh.nz[i0]) +
+                b1 * vec3(mesh.nx[i1], mesh.ny[i1], mesh.nz[i1]) +
+                b2 * vec3(mesh.nx[i2], mesh.ny[i2], mesh.nz[i2]));
+            rec.normal = rec.front_face ? shading : -shading;
+        }
+
+        if (mesh.has_uvs()) {
+            rec.u = b0 * mesh.u[i0] + b1 * mesh.u[i1] + b2 * mesh.u[i2];
+            rec.v = b0 * mesh.v[i0] + b1 * mesh.v[i1] + b2 * mesh.v[i2];
+        } else {
+            rec.u = b1;
+            rec.v = b2;
+        }
+
+        rec.mat = mat.id();
+    }
+};
+
+#endif
@@ -0,0 +1,738 @@
+#ifndef MESH_LOADER_H
+#define MESH_LOADER_H
+
+#include "mesh.h"
+#include "scheduler.h"
+
+#include <array>
+#include <charconv>
+#include <sstream>
+#include <unordered_map>
+
+// Loaders for Wavefront OBJ and binary PLY meshes. Files are mapped rather than read, and the
+// bulk of the parsing runs on a task_pool over independent byte ranges of the mapping.
+
+class mapped_file {
+  public:
+    // A whole file mapped read-only for a single front-to-back pass.
+
+    mapped_file(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            auto mapped = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                data = static_cast<const char*>(mapped);
+                size = size_t(info.st_size);
+                madvise(mapped, size, MADV_SEQUENTIAL);
+            }
+        }
+        close(fd);
+    }
+
+    ~mapped_file() {
+        if (data != nullptr)
+            munmap(const_cast<char*>(data), size);
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    const char* data = nullptr;
+    size_t size = 0;
+};
+
+class obj_loader {
+  public:
+    // Positions, normals, texture coordinates and polygonal faces, which are split into fans.
+    // Everything else (groups, materials, lines) is skipped.
+    //
+    // The file is cut at line breaks into ranges that are parsed in two parallel passes. The
+    // first counts the vertex records in each range, so that the second knows where each
+    // range's vertices start globally: it can then write them straight into place and resolve
+    // relative (negative) face indices on the spot.
+
+    static bool load(const char* data, size_t size, mesh_data& mesh, int threads = 0) {
+        task_pool pool(threads);
+        auto ranges = split_lines(data, size, resolve_worker_count(threads));
+
+        std::vector<range_result> results(ranges.size());
+        run(pool, ranges.size(), [&](size_t k) { count_records(ranges[k], results[k]); });
+
+        attribute_counts total;
+        for (auto& r : results) {
+            r.first = total;
+            total.positions += r.counts.positions;
+            total.normals += r.counts.normals;
+            total.uvs += r.counts.uvs;
+        }
+        if (total.positions > size_t(UINT32_MAX))
+            return false;
+
+        std::vector<float> normals[3], uvs[2];
+        mesh.x.resize(total.positions);
+        mesh.y.resize(total.positions);
+        mesh.z.resize(total.positions);
+        for (auto& n : normals) n.resize(total.normals);
+        for (auto& t : uvs) t.resize(total.uvs);
+
+        buffers out{&mesh, normals, uvs, total};
+        run(pool, ranges.size(), [&](size_t k) { parse_range(ranges[k], out, results[k]); });
+
+        for (const auto& r : results) {
+            if (!r.ok)
+                return false;
+        }
+        return build_indices(results, normals, uvs, mesh);
+    }
+
+  private:
+    struct line_range {
+        const char* begin;
+        const char* end;
+    };
+
+    struct attribute_counts {
+        size_t positions = 0, normals = 0, uvs = 0;
+    };
+
+    static constexpr int64_t missing = -1;  // Corner without this attribute
+
+    struct range_result {
+        attribute_counts counts;       // Vertex records in this range
+        attribute_counts first;        // Global index of this range's first record of each kind
+        std::vector<int64_t> corners;  // Three (position, uv, normal) triples per triangle
+        bool ok = true;
+    };
+
+    struct buffers {
+        mesh_data* mesh;
+        std::vector<float>* normals;
+        std::vector<float>* uvs;
+        attribute_counts total;
+    };
+
+    template <typename Func>
+    static void run(task_pool& pool, size_t count, Func&& task) {
+        task_pool::group all;
+        for (size_t k = 0; k < count; k++)
+            pool.spawn(all, [&task, k] { task(k); });
+        pool.wait(all);
+    }
+
+    static std::vector<line_range> split_lines(const char* data, size_t size, int workers) {
+        // A few ranges per worker, but none so small that task overhead dominates.
+        const size_t min_range = size_t(1) << 20;
+        size_t count = std::max<size_t>(1, std::min<size_t>(4 * workers, size / min_range));
+        std::vector<line_range> ranges;
+        const char* end = data + size;
+        const char* begin = data;
+        for (size_t k = 1; k <= count; k++) {
+            const char* cut = k == count ? end : data + size * k / count;
+            while (cut < end && cut[-1] != '\n')
+                cut++;
+            if (cut > begin)
+                ranges.push_back({begin, cut});
+            begin = cut;
+        }
+        return ranges;
+    }
+
+    static const char* skip_spaces(const char* p, const char* end) {
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        return p;
+    }
+
+    static const char* next_line(const char* p, const char* end) {
+        while (p < end && *p != '\n')
+            p++;
+        return p < end ? p + 1 : end;
+    }
+
+    static void count_records(const line_range& range, range_result& result) {
+        for (const char* p = range.begin; p < range.end; p = next_line(p, range.end)) {
+            p = skip_spaces(p, range.end);
+            if (range.end - p < 2 || p[0] != 'v')
+                continue;
+            if (p[1] == ' ' || p[1] == '\t')
+                result.counts.positions++;
+            else if (p[1] == 'n')
+                result.counts.normals++;
+            else if (p[1] == 't')
+                result.counts.uvs++;
+        }
+    }
+
+    static bool parse_floats(const char*& p, const char* end, float* values, int count) {
+        for (int k = 0; k < count; k++) {
+            p = skip_spaces(p, end);
+            auto [next, error] = std::from_chars(p, end, values[k]);
+            if (error != std::errc())
+                return false;
+            p = next;
+        }
+        return true;
+    }
+
+    static bool parse_index(const char*& p, const char* end, size_t defined, size_t total, int64_t& index) {
+        // OBJ indices count from 1, or backwards from the latest record when negative.
+        long long value;
+        auto [next, error] = std::from_chars(p, end, value);
+        if (error != std::errc() || value == 0)
+            return false;
+        p = next;
+        index = value > 0 ? value - 1 : int64_t(defined) + value;
+        return index >= 0 && size_t(index) < total;
+    }
+
+    static void parse_range(const line_range& range, buffers& out, range_result& result) {
+        auto seen = result.first;
+        std::vector<int64_t> polygon;
+
+        for (const char* p = range.begin; p < range.end; p = next_line(p, range.end)) {
+            p = skip_spaces(p, range.end);
+            if (range.end - p < 2)
+                continue;
+
+            if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+                p += 1;
+                float xyz[3];
+                if (!parse_floats(p, range.end, xyz, 3)) {
+                    result.ok = false;
+                    return;
+                }
+                out.mesh->x[seen.positions] = xyz[0];
+                out.mesh->y[seen.positions] = xyz[1];
+                out.mesh->z[seen.positions] = xyz[2];
+                seen.positions++;
+            } else if (p[0] == 'v' && p[1] == 'n') {
+                p += 2;
+                float n[3];
+                if (!parse_floats(p, range.end, n, 3)) {
+                    result.ok = false;
+                    return;
+                }
+                for (int axis = 0; axis < 3; axis++)
+                    out.normals[axis][seen.normals] = n[axis];
+                seen.normals++;
+            } else if (p[0] == 'v' && p[1] == 't') {
+                p += 2;
+                // The second coordinate is optional, and a third (w) is ignored.
+                float uv[2] = {0, 0};
+                if (!parse_floats(p, range.end, uv, 1)) {
+                    result.ok = false;
+                    return;
+                }
+                parse_floats(p, range.end, uv + 1, 1);
+                out.uvs[0][seen.uvs] = uv[0];
+                out.uvs[1][seen.uvs] = uv[1];
+                seen.uvs++;
+            } else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+                p += 1;
+                polygon.clear();
+                if (!parse_face(p, range.end, seen, out.total, polygon)) {
+                    result.ok = false;
+                    return;
+                }
+                for (size_t k = 2; k < polygon.size() / 3; k++) {
+                    result.corners.insert(result.corners.end(), polygon.begin(), polygon.begin() + 3);
+                    result.corners.insert(result.corners.end(), polygon.begin() + 3*(k-1), polygon.begin() + 3*(k+1));
+                }
+            }
+        }
+    }
+
+    static bool parse_face(
+        const char*& p, const char* end, const attribute_counts& seen, const attribute_counts& total,
+        std::vector<int64_t>& polygon
+    ) {
+        // Appends a (position, uv, normal) triple for each corner: v, v/vt, v//vn or v/vt/vn.
+        while (true) {
+            p = skip_spaces(p, end);
+            if (p == end || *p == '\n' || *p == '\r' || *p == '#')
+                return polygon.size() >= 9;
+
+            int64_t position, uv = missing, normal = missing;
+            if (!parse_index(p, end, seen.positions, total.positions, position))
+                return false;
+            if (p < end && *p == '/') {
+                p++;
+                if (p < end && *p != '/' && !parse_index(p, end, seen.uvs, total.uvs, uv))
+                    return false;
+                if (p < end && *p == '/') {
+                    p++;
+                    if (!parse_index(p, end, seen.normals, total.normals, normal))
+                        return false;
+                }
+            }
+            polygon.push_back(position);
+            polygon.push_back(uv);
+            polygon.push_back(normal);
+        }
+    }
+
+    static bool build_indices(
+        const std::vector<range_result>& results, const std::vector<float>* normals,
+        const std::vector<float>* uvs, mesh_data& mesh
+    ) {
+        // A mesh vertex carries one of each attribute, while OBJ corners index them separately.
+        // Normals and UVs are kept only if every corner has them; each distinct combination
+        // then becomes a mesh vertex. Without them the position indices are used as they are.
+        bool use_uvs = true, use_normals = true;
+        size_t corner_count = 0;
+        for (const auto& r : results) {
+            corner_count += r.corners.size() / 3;
+            for (size_t c = 0; c < r.corners.size(); c += 3) {
+                use_uvs = use_uvs && r.corners[c + 1] != missing;
+                use_normals = use_normals && r.corners[c + 2] != missing;
+            }
+        }
+        if (corner_count / 3 > size_t(UINT32_MAX))
+            return false;
+        mesh.indices.reserve(corner_count);
+
+        if (!use_uvs && !use_normals) {
+            for (const auto& r : results) {
+                for (size_t c = 0; c < r.corners.size(); c += 3)
+                    mesh.indices.push_back(uint32_t(r.corners[c]));
+            }
+            return true;
+        }
+
+        struct corner_hash {
+            size_t operator()(const std::array<int64_t, 3>& c) const {
+                return std::hash<int64_t>()(c[0] * 73856093 ^ c[1] * 19349663 ^ c[2] * 83492791);
+            }
+        };
+        std::unordered_map<std::array<int64_t, 3>, uint32_t, corner_hash> vertex_of;
+        mesh_data split;
+
+        for (const auto& r : results) {
+            for (size_t c = 0; c < r.corners.size(); c += 3) {
+                std::array<int64_t, 3> key = {
+                    r.corners[c], use_uvs ? r.corners[c + 1] : missing, use_normals ? r.corners[c + 2] : missing
+                };
+                auto [it, inserted] = vertex_of.try_emplace(key, uint32_t(split.vertex_count()));
+                if (inserted) {
+                    split.add_vertex(mesh.x[key[0]], mesh.y[key[0]], mesh.z[key[0]]);
+                    if (use_uvs) {
+                        split.u.push_back(uvs[0][key[1]]);
+                        split.v.push_back(uvs[1][key[1]]);
+                    }
+                    if (use_normals) {
+                        split.nx.push_back(normals[0][key[2]]);
+                        split.ny.push_back(normals[1][key[2]]);
+                        split.nz.push_back(normals[2][key[2]]);
+                    }
+                }
+                split.indices.push_back(it->second);
+            }
+        }
+
+        mesh = std::move(split);
+        return true;
+    }
+};
+
+class ply_loader {
+  public:
+    // Binary PLY, either byte order. Vertices take x/y/z and, when present, nx/ny/nz and u/v
+    // (or s/t); faces take their vertex_indices list, with polygons split into fans. Other
+    // elements and properties are skipped.
+    //
+    // Vertex records have a fixed size, so they are converted in parallel ranges. Face
+    // records are lists; when they are all triangles they have a fixed size too and are
+    // converted the same way, otherwise they are walked in order.
+
+    static bool load(const char* data, size_t size, mesh_data& mesh, int threads = 0) {
+        return ply_loader().read(data, size, mesh, threads);
+    }
+
+  private:
+    enum class scalar { int8, uint8, int16, uint16, int32, uint32, float32, float64 };
+
+    struct property {
+        std::string name;
+        scalar type;
+        bool is_list = false;
+        scalar count_type = scalar::uint8;  // Lists only: type of the length prefix
+    };
+
+    struct element {
+        std::string name;
+        size_t count;
+        std::vector<property> properties;
+
+        size_t record_size() const {
+            // Bytes per record, or 0 if it holds a list.
+            size_t total = 0;
+            for (const auto& p : properties) {
+                if (p.is_list)
+                    return 0;
+                total += scalar_size(p.type);
+            }
+            return total;
+        }
+    };
+
+    std::vector<element> elements;
+    bool swap_bytes = false;  // File byte order differs from the host's
+
+    bool read(const char* data, size_t size, mesh_data& mesh, int threads) {
+        const char* end = data + size;
+        const char* body;
+        if (!parse_header(data, end, body))
+            return false;
+
+        task_pool pool(threads);
+        int workers = resolve_worker_count(threads);
+        const char* p = body;
+
+        for (const auto& e : elements) {
+            if (e.name == "vertex") {
+                if (!load_vertices(pool, workers, e, p, end, mesh))
+                    return false;
+            } else if (e.name == "face") {
+                if (!load_faces(pool, workers, e, p, end, mesh))
+                    return false;
+            } else if (!skip_element(e, p, end)) {
+                return false;
+            }
+        }
+
+        for (auto index : mesh.indices) {
+            if (index >= mesh.vertex_count())
+                return false;
+        }
+        return true;
+    }
+
+    static size_t scalar_size(scalar type) {
+        switch (type) {
+            case scalar::int8:    case scalar::uint8:  return 1;
+            case scalar::int16:   case scalar::uint16: return 2;
+            case scalar::float64:                      return 8;
+            default:                                   return 4;
+        }
+    }
+
+    static bool parse_scalar_name(const std::string& name, scalar& type) {
+        static const std::pair<const char*, scalar> names[] = {
+            {"char", scalar::int8},     {"int8", scalar::int8},     {"uchar", scalar::uint8},
+            {"uint8", scalar::uint8},   {"short", scalar::int16},   {"int16", scalar::int16},
+            {"ushort", scalar::uint16}, {"uint16", scalar::uint16}, {"int", scalar::int32},
+            {"int32", scalar::int32},   {"uint", scalar::uint32},   {"uint32", scalar::uint32},
+            {"float", scalar::float32}, {"float32", scalar::float32}, {"double", scalar::float64},
+            {"float64", scalar::float64},
+        };
+        for (const auto& [n, t] : names) {
+            if (name == n) {
+                type = t;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    template <typename T>
+    T load_value(const char* p) const {
+        // Each type swaps a fixed number of bytes, which the compiler can see stays in bounds.
+        unsigned char bytes[sizeof(T)];
+        std::memcpy(bytes, p, sizeof(T));
+        if (swap_bytes) {
+            for (size_t i = 0; i < sizeof(T) / 2; i++)
+                std::swap(bytes[i], bytes[sizeof(T) - 1 - i]);
+        }
+        T v;
+        std::memcpy(&v, bytes, sizeof(T));
+        return v;
+    }
+
+    double read_scalar(scalar type, const char* p) const {
+        switch (type) {
+            case scalar::int8:    return load_value<int8_t>(p);
+            case scalar::uint8:   return load_value<uint8_t>(p);
+            case scalar::int16:   return load_value<int16_t>(p);
+            case scalar::uint16:  return load_value<uint16_t>(p);
+            case scalar::int32:   return load_value<int32_t>(p);
+            case scalar::uint32:  return load_value<uint32_t>(p);
+            case scalar::float32: return load_value<float>(p);
+            default:              return load_value<double>(p);
+        }
+    }
+
+    int64_t read_integer(scalar type, const char* p) const {
+        // For list lengths and indices, whose types parse_header only lets be integers.
+        switch (type) {
+            case scalar::int8:   return load_value<int8_t>(p);
+            case scalar::uint8:  return load_value<uint8_t>(p);
+            case scalar::int16:  return load_value<int16_t>(p);
+            case scalar::uint16: return load_value<uint16_t>(p);
+            case scalar::int32:  return load_value<int32_t>(p);
+            default:             return load_value<uint32_t>(p);
+        }
+    }
+
+    static bool is_integer(scalar type) {
+        return type != scalar::float32 && type != scalar::float64;
+    }
+
+    uint32_t read_index(scalar type, const char* p) const {
+        // Negative indices become UINT32_MAX, which the vertex count check then rejects.
+        auto index = read_integer(type, p);
+        return index < 0 ? UINT32_MAX : uint32_t(index);
+    }
+
+    bool parse_header(const char* data, const char* end, const char*& body) {
+        elements.clear();
+        const char* p = data;
+        auto line = [&](std::string& text) {
+            const char* start = p;
+            while (p < end && *p != '\n')
+                p++;
+            if (p == end)
+                return false;
+            text.assign(start, p - start);
+            if (!text.empty() && text.back() == '\r')
+                text.pop_back();
+            p++;
+            return true;
+        };
+
+        std::string text;
+        if (!line(text) || text != "ply")
+            return false;
+
+        bool have_format = false;
+        while (line(text)) {
+            std::istringstream words(text);
+            std::string keyword;
+            words >> keyword;
+
+            if (keyword == "format") {
+                std::string format;
+                words >> format;
+                if (format != "binary_little_endian" && format != "binary_big_endian")
+                    return false;
+                uint16_t probe = 1;
+                bool little_endian_host = *reinterpret_cast<uint8_t*>(&probe) == 1;
+                swap_bytes = (format == "binary_little_endian") != little_endian_host;
+                have_format = true;
+            } else if (keyword == "element") {
+                element e;
+                if (!(words >> e.name >> e.count))
+                    return false;
+                elements.push_back(e);
+            } else if (keyword == "property") {
+                if (elements.empty())
+                    return false;
+                property prop;
+                std::string type;
+                words >> type;
+                if (type == "list") {
+                    std::string count_type, item_type;
+                    words >> count_type >> item_type;
+                    prop.is_list = true;
+                    if (!parse_scalar_name(count_type, prop.count_type) || !parse_scalar_name(item_type, prop.type)
+                        || !is_integer(prop.count_type))
+                        return false;
+                } else if (!parse_scalar_name(type, prop.type)) {
+                    return false;
+                }
+                words >> prop.name;
+                elements.back().properties.push_back(prop);
+            } else if (keyword == "end_header") {
+                body = p;
+                return have_format;
+            }
+        }
+        return false;
+    }
+
+    bool skip_element(const element& e, const char*& p, const char* end) {
+        if (auto size = e.record_size(); size > 0) {
+            if (size_t(end - p) / size < e.count)
+                return false;
+            p += e.count * size;
+            return true;
+        }
+
+        for (size_t r = 0; r < e.count; r++) {
+            for (const auto& prop : e.properties) {
+                if (!skip_property(prop, p, end))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    bool skip_property(const property& prop, const char*& p, const char* end) {
+        size_t bytes = scalar_size(prop.type);
+        if (prop.is_list) {
+            if (size_t(end - p) < scalar_size(prop.count_type))
+                return false;
+            auto n = read_integer(prop.count_type, p);
+            p += scalar_size(prop.count_type);
+            if (n < 0 || size_t(n) > size_t(end - p) / bytes)
+                return false;
+            bytes *= size_t(n);
+        }
+        if (size_t(end - p) < bytes)
+            return false;
+        p += bytes;
+        return true;
+    }
+
+    bool load_vertices(task_pool& pool, int workers, const element& e, const char*& p, const char* end, mesh_data& mesh) {
+        auto stride = e.record_size();
+        if (stride == 0 || size_t(end - p) / stride < e.count)
+            return false;
+
+        // Byte offset of each attribute within a record, or -1 if absent.
+        const char* wanted[8] = {"x", "y", "z", "nx", "ny", "nz", "u", "v"};
+        long offset[8];
+        scalar type[8];
+        size_t position = 0;
+        std::fill(offset, offset + 8, -1L);
+        for (const auto& prop : e.properties) {
+            for (int k = 0; k < 8; k++) {
+                bool alias = (k == 6 && (prop.name == "s" || prop.name == "texture_u"))
+                          || (k == 7 && (prop.name == "t" || prop.name == "texture_v"));
+                if (prop.name == wanted[k] || alias) {
+                    offset[k] = long(position);
+                    type[k] = prop.type;
+                }
+            }
+            position += scalar_size(prop.type);
+        }
+        if (offset[0] < 0 || offset[1] < 0 || offset[2] < 0)
+            return false;
+        bool normals = offset[3] >= 0 && offset[4] >= 0 && offset[5] >= 0;
+        bool uvs = offset[6] >= 0 && offset[7] >= 0;
+
+        std::vector<float>* columns[8] = {&mesh.x, &mesh.y, &mesh.z, &mesh.nx, &mesh.ny, &mesh.nz, &mesh.u, &mesh.v};
+        for (int k = 0; k < 8; k++) {
+            bool used = k < 3 || (k < 6 ? normals : uvs);
+            if (used)
+                columns[k]->resize(e.count);
+            else
+                offset[k] = -1;
+        }
+
+        const char* records = p;
+        parallel_ranges(pool, workers, e.count, [&](size_t first, size_t last) {
+            for (size_t r = first; r < last; r++) {
+                const char* record = records + r * stride;
+                for (int k = 0; k < 8; k++) {
+                    if (offset[k] >= 0)
+                        (*columns[k])[r] = float(read_scalar(type[k], record + offset[k]));
+                }
+            }
+        });
+
+        p += e.count * stride;
+        return true;
+    }
+
+    bool load_faces(task_pool& pool, int workers, const element& e, const char*& p, const char* end, mesh_data& mesh) {
+        const property* list = nullptr;
+        for (const auto& prop : e.properties) {
+            if (prop.is_list && (prop.name == "vertex_indices" || prop.name == "vertex_index"))
+                list = &prop;
+        }
+        if (list == nullptr || !is_integer(list->type))
+            return false;
+
+        // The fast path: the list is the only property and every face is a triangle, so each
+        // record has the same size and triangle f is at a known offset.
+        auto count_size = scalar_size(list->count_type), index_size = scalar_size(list->type);
+        auto stride = count_size + 3 * index_size;
+        if (e.properties.size() == 1 && size_t(end - p) / stride >= e.count) {
+            const char* records = p;
+            auto base = mesh.indices.size();
+            mesh.indices.resize(base + 3 * e.count);
+            std::atomic<bool> all_triangles{true};
+            parallel_ranges(pool, workers, e.count, [&](size_t first, size_t last) {
+                for (size_t f = first; f < last && all_triangles; f++) {
+                    const char* record = records + f * stride;
+                    if (read_integer(list->count_type, record) != 3) {
+                        all_triangles = false;
+                        return;
+                    }
+                    for (int k = 0; k < 3; k++)
+                        mesh.indices[base + 3*f + k] = read_index(list->type, record + count_size + k * index_size);
+                }
+            });
+            if (all_triangles) {
+                p += e.count * stride;
+                return true;
+            }
+            mesh.indices.resize(base);
+        }
+
+        std::vector<uint32_t> polygon;
+        for (size_t f = 0; f < e.count; f++) {
+            for (const auto& prop : e.properties) {
+                if (&prop != list) {
+                    if (!skip_property(prop, p, end))
+                        return false;
+                    continue;
+                }
+
+                if (size_t(end - p) < count_size)
+                    return false;
+                auto count = read_integer(prop.count_type, p);
+                p += count_size;
+                if (count < 0 || size_t(end - p) / index_size < size_t(count))
+                    return false;
+                auto n = size_t(count);
+                polygon.resize(n);
+                for (size_t k = 0; k < n; k++, p += index_size)
+                    polygon[k] = read_index(prop.type, p);
+                for (size_t k = 2; k < n; k++)
+                    mesh.add_triangle(polygon[0], polygon[k-1], polygon[k]);
+            }
+        }
+        return true;
+    }
+
+    template <typename Func>
+    static void parallel_ranges(task_pool& pool, int workers, size_t count, Func&& convert) {
+        // Calls convert(first, last) over a partition of [0, count).
+        const size_t min_range = 16384;
+        size_t ranges = std::max<size_t>(1, std::min<size_t>(4 * workers, count / min_range));
+        task_pool::group all;
+        for (size_t k = 0; k < ranges; k++)
+            pool.spawn(all, [&convert, k, ranges, count] { convert(count * k / ranges, count * (k + 1) / ranges); });
+        pool.wait(all);
+    }
+};
+
+inline bool load_mesh(const std::string& path, mesh_data& mesh, int threads = 0) {
+    // Loads an .obj or .ply file into `mesh`, replacing its contents. Returns false, with an
+    // error on stderr, if the file cannot be read or parsed.
+    mesh = mesh_data();
+    mapped_file file(path);
+    auto extension = path.substr(path.find_last_of('.') + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+    bool ok = file.data != nullptr;
+    if (ok && extension == "obj")
+        ok = obj_loader::load(file.data, file.size, mesh, threads);
+    else if (ok && extension == "ply")
+        ok = ply_loader::load(file.data, file.size, mesh, threads);
+    else
+        ok = false;
+
+    if (!ok) {
+        std::cerr << "ERROR: Could not load mesh file '" << path << "'.\n";
+        mesh = mesh_data();
+    }
+    return ok;
+}
+
+#endif
@@ -0,0 +1,520 @@
+#ifndef OUT_OF_CORE_H
+#define OUT_OF_CORE_H
+
+#include "bvh.h"
+#include "shapes.h"
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// Geometry too large for memory lives in a chunk file: spheres grouped into chunks, each with
+// its own BVH, laid out so a chunk can be paged in or dropped as a unit. The file is mapped
+// rather than read, so an evicted chunk is only ever slower to reach, never invalid.
+
+struct packed_sphere {
+    float    center[3];
+    float    radius;
+    uint32_t material;  // Index into the palette the geometry is opened with
+};
+
+struct geometry_chunk {
+    // Directory entry for one chunk. The chunk holds node_count BVH nodes followed by
+    // sphere_count spheres in leaf order, starting at a multiple of geometry_chunk_alignment.
+    float    bounds_min[3];
+    float    bounds_max[3];
+    uint64_t offset;  // Byte offset of the chunk from the start of the file
+    uint64_t size;    // Bytes in the chunk
+    uint32_t node_count;
+    uint32_t sphere_count;
+};
+
+struct geometry_file_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t chunk_count;
+    uint64_t directory_offset;  // Byte offset of the chunk directory, after the last chunk
+};
+
+static constexpr char     geometry_file_magic[8] = {'R','T','O','O','C','\0','\0','\0'};
+static constexpr uint32_t geometry_file_version = 2;
+
+// Chunks start at multiples of this, so each begins on a page boundary (and madvise accepts
+// its range) under 4, 16 and 64 KiB pages alike.
+static constexpr uint64_t geometry_chunk_alignment = 64 * 1024;
+
+inline bool geometry_file_current(const std::string& path) {
+    // True if `path` starts with the header of a chunk file this version reads.
+    geometry_file_header header{};
+    std::ifstream in(path, std::ios::binary);
+    return in.read(reinterpret_cast<char*>(&header), sizeof(header))
+        && std::memcmp(header.magic, geometry_file_magic, sizeof(geometry_file_magic)) == 0
+        && header.version == geometry_file_version;
+}
+
+inline void release_geometry_pages(const char* start, size_t bytes) {
+    // Advises the kernel to drop a chunk's pages. If it refuses, pages are never given back
+    // and the cache's byte budget cannot hold, which is reported once.
+    static std::atomic<bool> reported{false};
+    if (madvise(const_cast<char*>(start), bytes, MADV_DONTNEED) != 0 && !reported.exchange(true))
+        std::clog << "Could not release geometry pages (" << std::strerror(errno)
+                  << "); the geometry cache budget is not enforced.\n";
+}
+
+class chunked_geometry_writer {
+  public:
+    // Streams spheres into a chunk file without holding more than one chunk in memory. Each
+    // run of chunk_size consecutive spheres becomes a chunk, so generators should emit
+    // spatially coherent runs (a city block at a time, say) to keep chunk bounds tight.
+
+    chunked_geometry_writer(const std::string& path, size_t chunk_size = 1 << 13)
+      : path(path), temp_path(path + ".tmp"), chunk_size(std::max<size_t>(chunk_size, 1)),
+        out(temp_path, std::ios::binary)
+    {
+        geometry_file_header header{};
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        pad_to_chunk();
+    }
+
+    void add_sphere(const point3& center, double radius, uint32_t material) {
+        pending.push_back({{float(center.x()), float(center.y()), float(center.z())}, float(radius), material});
+        if (pending.size() >= chunk_size)
+            flush_chunk();
+    }
+
+    bool finish() {
+        // Writes the directory and header and moves the file into place. Returns false if
+        // anything failed to write.
+        flush_chunk();
+
+        geometry_file_header header{};
+        std::memcpy(header.magic, geometry_file_magic, sizeof(geometry_file_magic));
+        header.version = geometry_file_version;
+        header.chunk_count = uint32_t(directory.size());
+        header.directory_offset = uint64_t(out.tellp());
+        out.write(reinterpret_cast<const char*>(directory.data()), directory.size() * sizeof(geometry_chunk));
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.close();
+        if (!out)
+            return false;
+        return std::rename(temp_path.c_str(), path.c_str()) == 0;
+    }
+
+  private:
+    std::string path, temp_path;
+    size_t chunk_size;
+    std::ofstream out;
+    std::vector<packed_sphere> pending;
+    std::vector<geometry_chunk> directory;
+
+    void flush_chunk() {
+        if (pending.empty())
+            return;
+
+        std::vector<bvh_primitive> prims(pending.size());
+        for (size_t i = 0; i < pending.size(); i++) {
+            auto box = sphere_bounds(pending[i]);
+            prims[i] = {box, box.centroid(), i};
+        }
+        linear_bvh tree(std::move(prims), bvh_build_options());
+
+        geometry_chunk chunk{};
+        auto root = linear_bvh::make_node(tree.bounds);
+        std::copy_n(root.bounds_min, 3, chunk.bounds_min);
+        std::copy_n(root.bounds_max, 3, chunk.bounds_max);
+        chunk.offset = uint64_t(out.tellp());
+        chunk.node_count = uint32_t(tree.nodes.size());
+        chunk.sphere_count = uint32_t(pending.size());
+        chunk.size = tree.nodes.size() * sizeof(linear_bvh_node) + pending.size() * sizeof(packed_sphere);
+
+        out.write(reinterpret_cast<const char*>(tree.nodes.data()), tree.nodes.size() * sizeof(linear_bvh_node));
+        for (auto index : tree.primitive_order)
+            out.write(reinterpret_cast<const char*>(&pending[index]), sizeof(packed_sphere));
+        pad_to_chunk();
+
+        directory.push_back(chunk);
+        pending.clear();
+    }
+
+    void pad_to_chunk() {
+        auto position = uint64_t(out.tellp());
+        auto padded = (position + geometry_chunk_alignment - 1) / geometry_chunk_alignment * geometry_chunk_alignment;
+        std::vector<char> zeros(padded - position);
+        out.write(zeros.data(), zeros.size());
+    }
+
+  public:
+    static aabb sphere_bounds(const packed_sphere& s) {
+        auto c = point3(s.center[0], s.center[1], s.center[2]);
+        auto rvec = vec3(s.radius, s.radius, s.radius);
+        return aabb(c - rvec, c + rvec);
+    }
+};
+
+class chunk_cache {
+  public:
+    // Tracks which chunks of a mapped file are resident and keeps their total size within a
+    // byte budget. Misses are queued for a background loader that faults the chunk's pages
+    // in, evicting the least recently used chunks to make room. Eviction only advises the
+    // kernel to drop the pages, so a ray still walking an evicted chunk reads it back from
+    // the file.
+
+    chunk_cache(const char* base, const std::vector<geometry_chunk>& chunks, size_t capacity_bytes)
+      : base(base), chunks(chunks), capacity(capacity_bytes), page_size(uint64_t(sysconf(_SC_PAGESIZE))),
+        slots(new slot[chunks.size()])
+    {
+        loader = std::thread([this] { load_requests(); });
+    }
+
+    ~chunk_cache() {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            stopping = true;
+        }
+        queue_ready.notify_all();
+        loader.join();
+    }
+
+    bool acquire(uint32_t chunk) {
+        // True if `chunk` is resident, refreshing its place in the eviction order.
+        auto now = lookups.fetch_add(1, std::memory_order_relaxed);
+        auto& s = slots[chunk];
+        if (s.state.load(std::memory_order_acquire) != resident) {
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        s.last_used.store(now, std::memory_order_relaxed);
+        return true;
+    }
+
+    void request(uint32_t chunk) {
+        // Queues a load of `chunk` unless one is already pending.
+        int expected = absent;
+        if (!slots[chunk].state.compare_exchange_strong(expected, queued))
+            return;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            queue.push_back(chunk);
+        }
+        queue_ready.notify_one();
+    }
+
+    void load_now(uint32_t chunk) { page_in(chunk); }
+
+    void report() const {
+        auto total = lookups.load();
+        auto missed = misses.load();
+        std::clog << "Geometry cache: " << total << " chunk lookups, "
+                  << (total > 0 ? 100.0 * (total - missed) / total : 100.0) << "% hit rate, "
+                  << loads.load() << " loads, " << evictions.load() << " evictions.\n";
+    }
+
+  private:
+    enum { absent, queued, resident };
+
+    struct slot {
+        std::atomic<int> state{absent};
+        std::atomic<uint64_t> last_used{0};
+    };
+
+    const char* base;
+    const std::vector<geometry_chunk>& chunks;
+    size_t capacity;
+    uint64_t page_size;
+    std::unique_ptr<slot[]> slots;
+
+    std::mutex residency_mutex;  // Guards resident_chunks and resident_bytes
+    std::vector<uint32_t> resident_chunks;
+    size_t resident_bytes = 0;
+
+    std::mutex queue_mutex;
+    std::condition_variable queue_ready;
+    std::deque<uint32_t> queue;
+    bool stopping = false;
+    std::thread loader;
+
+    std::atomic<uint64_t> lookups{0}, misses{0}, loads{0}, evictions{0};
+
+    void load_requests() {
+        while (true) {
+            uint32_t chunk;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_ready.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (stopping)
+                    return;
+                chunk = queue.front();
+                queue.pop_front();
+            }
+            page_in(chunk);
+        }
+    }
+
+    void page_in(uint32_t chunk) {
+        std::lock_guard<std::mutex> lock(residency_mutex);
+        auto& s = slots[chunk];
+        if (s.state.load() == resident)
+            return;
+
+        const auto& entry = chunks[chunk];
+        while (!resident_chunks.empty() && resident_bytes + entry.size > capacity)
+            evict_least_recent();
+
+        // Chunks start on page boundaries, so the advice covers exactly this chunk's pages. It
+        // is only a hint; touching every page is what makes the chunk resident.
+        auto start = const_cast<char*>(base + entry.offset);
+        madvise(start, entry.size, MADV_WILLNEED);
+        volatile char sink = 0;
+        for (uint64_t page = 0; page < entry.size; page += page_size)
+            sink = sink + start[page];
+
+        resident_chunks.push_back(chunk);
+        resident_bytes += entry.size;
+        s.last_used.store(lookups.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        s.state.store(resident, std::memory_order_release);
+        loads++;
+    }
+
+    void evict_least_recent() {
+        size_t oldest = 0;
+        for (size_t k = 1; k < resident_chunks.size(); k++) {
+            if (slots[resident_chunks[k]].last_used.load(std::memory_order_relaxed)
+                < slots[resident_chunks[oldest]].last_used.load(std::memory_order_relaxed))
+                oldest = k;
+        }
+
+        auto chunk = resident_chunks[oldest];
+        resident_chunks[oldest] = resident_chunks.back();
+        resident_chunks.pop_back();
+        resident_bytes -= chunks[chunk].size;
+        slots[chunk].state.store(absent, std::memory_order_release);
+        release_geometry_pages(base + chunks[chunk].offset, chunks[chunk].size);
+        evictions++;
+    }
+};
+
+class streamed_geometry : public hittable {
+  public:
+    // Spheres read from a chunk file on demand. A small in-memory BVH over the chunk bounds
+    // finds the chunks a ray crosses; each resident chunk is then traversed in place through
+    // its own mapped BVH. A ray that reaches a chunk that is not resident queues it for
+    // loading and is deferred (see ray_deferral) rather than waiting for the disk.
+
+    streamed_geometry(const std::string& path, const std::vector<shared_ptr<material>>& materials, size_t cache_bytes) {
+        for (const auto& mat : materials)
+            palette.emplace_back(mat);
+        if (palette.empty()) {
+            std::cerr << "ERROR: No materials for geometry file '" << path << "'.\n";
+            return;
+        }
+
+        if (!open_file(path)) {
+            std::cerr << "ERROR: Could not open geometry file '" << path << "'.\n";
+            return;
+        }
+
+        std::vector<bvh_primitive> prims(chunks.size());
+        for (size_t c = 0; c < chunks.size(); c++) {
+            const auto& e = chunks[c];
+            aabb box(point3(e.bounds_min[0], e.bounds_min[1], e.bounds_min[2]),
+                     point3(e.bounds_max[0], e.bounds_max[1], e.bounds_max[2]));
+            prims[c] = {box, box.centroid(), c};
+        }
+        bvh_build_options options;
+        options.max_leaf_size = 1;
+        linear_bvh tree(std::move(prims), options);
+        top_nodes = std::move(tree.nodes);
+        chunk_order = std::move(tree.primitive_order);
+        bbox = tree.bounds;
+
+        cache = std::make_unique<chunk_cache>(data, chunks, cache_bytes);
+    }
+
+    ~streamed_geometry() {
+        cache.reset();
+        if (data != nullptr)
+            munmap(const_cast<char*>(data), size);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (top_nodes.empty())
+            return false;
+
+        const point3& origin = r.origin();
+        const vec3& direction = r.direction();
+        vec3 inv_dir(1.0 / direction.x(), 1.0 / direction.y(), 1.0 / direction.z());
+        bool dir_is_neg[3] = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
+
+        bool hit_anything = false;
+        uint32_t stack[linear_bvh::max_depth];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while (stack_size > 0) {
+            auto current = stack[--stack_size];
+            const auto& node = top_nodes[current];
+            if (!linear_bvh::node_hit(node, origin, inv_dir, ray_t))
+                continue;
+
+            if (node.count == 0) {
+                // Push the farther child first, so the nearer one is visited next.
+                bool right_first = dir_is_neg[node.axis];
+                stack[stack_size++] = right_first ? current + 1 : node.offset;
+                stack[stack_size++] = right_first ? node.offset : current + 1;
+                continue;
+            }
+
+            for (uint32_t slot = node.offset; slot < node.offset + node.count; slot++) {
+                auto chunk = uint32_t(chunk_order[slot]);
+                if (!cache->acquire(chunk)) {
+                    if (!ray_deferral::blocking()) {
+                        cache->request(chunk);
+                        ray_deferral::pending() = true;
+                        return false;
+                    }
+                    cache->load_now(chunk);
+                }
+                if (hit_chunk(chunks[chunk], r, inv_dir, ray_t, rec)) {
+                    hit_anything = true;
+                    ray_t.max = rec.t;
+                }
+            }
+        }
+
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    void report_cache() const {
+        if (cache)
+            cache->report();
+    }
+
+  private:
+    std::vector<material_handle> palette;
+    const char* data = nullptr;
+    size_t size = 0;
+    std::vector<geometry_chunk> chunks;
+    std::vector<linear_bvh_node> top_nodes;
+    std::vector<size_t> chunk_order;
+    std::unique_ptr<chunk_cache> cache;
+    aabb bbox;
+
+    bool open_file(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat info;
+        void* mapped = MAP_FAILED;
+        if (fstat(fd, &info) == 0 && size_t(info.st_size) >= sizeof(geometry_file_header)) {
+            size = size_t(info.st_size);
+            mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (mapped == MAP_FAILED)
+            return false;
+        data = static_cast<const char*>(mapped);
+
+        geometry_file_header header;
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, geometry_file_magic, sizeof(geometry_file_magic)) != 0
+            || header.version != geometry_file_version
+            || header.directory_offset > size
+            || uint64_t(header.chunk_count) * sizeof(geometry_chunk) > size - header.directory_offset)
+            return false;
+
+        chunks.resize(header.chunk_count);
+        std::memcpy(chunks.data(), data + header.directory_offset, chunks.size() * sizeof(geometry_chunk));
+        for (const auto& c : chunks) {
+            auto needed = uint64_t(c.node_count) * sizeof(linear_bvh_node) + uint64_t(c.sphere_count) * sizeof(packed_sphere);
+            if (c.node_count == 0 || c.offset % geometry_chunk_alignment != 0 || c.size != needed
+                || c.offset > size || c.size > size - c.offset)
+                return false;
+
+            // Check the chunk's tree once here, so hit_chunk can walk it unchecked. The node
+            // pages are dropped again afterwards, leaving residency to the cache's budget.
+            auto nodes = reinterpret_cast<const linear_bvh_node*>(data + c.offset);
+            if (!linear_bvh::valid_nodes(nodes, c.node_count, c.sphere_count))
+                return false;
+            release_geometry_pages(data + c.offset, c.node_count * sizeof(linear_bvh_node));
+        }
+        return true;
+    }
+
+    bool hit_chunk(
+        const geometry_chunk& chunk, const ray& r, const vec3& inv_dir, interval ray_t, hit_record& rec
+    ) const {
+        auto nodes = reinterpret_cast<const linear_bvh_node*>(data + chunk.offset);
+        auto spheres = reinterpret_cast<const packed_sphere*>(nodes + chunk.node_count);
+        bool dir_is_neg[3] = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
+
+        bool hit_anything = false;
+        uint32_t stack[linear_bvh::max_depth];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while (stack_size > 0) {
+            auto current = stack[--stack_size];
+            const auto& node = nodes[current];
+            trace_stats::node_visit(1);
+            if (!linear_bvh::node_hit(node, r.origin(), inv_dir, ray_t))
+                continue;
+
+            if (node.count == 0) {
+                // Push the farther child first, so the nearer one is visited next.
+                bool right_first = dir_is_neg[node.axis];
+                stack[stack_size++] = right_first ? current + 1 : node.offset;
+                stack[stack_size++] = right_first ? node.offset : current + 1;
+                continue;
+            }
+
+            trace_stats::primitive_tests(node.count);
+            for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                if (hit_sphere(spheres[i], r, ray_t, rec)) {
+                    hit_anything = true;
+                    ray_t.max = rec.t;
+                }
+            }
+        }
+
+        return hit_anything;
+    }
+
+    bool hit_sphere(const packed_sphere& s, const ray& r, interval ray_t, hit_record& rec) const {
+        // As sphere::hit, for a stationary sphere.
+        point3 center(s.center[0], s.center[1], s.center[2]);
+        double radius = s.radius;
+        vec3 oc = center - r.origin();
+        auto a = r.direction().length_squared();
+        auto h = dot(r.direction(), oc);
+        auto c = oc.length_squared() - radius*radius;
+
+        auto discriminant = h*h - a*c;
+        if (discriminant < 0)
+            return false;
+
+        auto sqrtd = std::sqrt(discriminant);
+        auto root = (h - sqrtd) / a;
+        if (!ray_t.surrounds(root)) {
+            root = (h + sqrtd) / a;
+            if (!ray_t.surrounds(root))
+                return false;
+        }
+
+        rec.t = root;
+        rec.p = r.at(rec.t);
+        vec3 outward_normal = (rec.p - center) / radius;
+        rec.set_face_normal(r, outward_normal);
+        sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+        rec.mat = palette[std::min<size_t>(s.material, palette.size() - 1)].id();
+        return true;
+    }
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "hittable.h"
 #include "hittable_list.h"
+#include "material.h"
 
 class quad : public hittable {
   public:
@@ -46,12 +47,29 @@ class quad : public hittable {
             return false;
         rec.t = t;
         rec.p = intersection;
-        rec.mat = mat;
+        rec.mat = mat.id();
         rec.set_face_normal(r, normal);
 
         return true;
     }
 
+    bool occluded(const ray& r, interval ray_t) const override {
+        auto denom = dot(normal, r.direction());
+        if (std::fabs(denom) < 1e-8)
+            return false;
+
+        auto t = (D - dot(normal, r.origin())) / denom;
+        if (!ray_t.contains(t))
+            return false;
+
+        // is_interior's test without its UVs; a shape that overrides is_interior must
+        // override this too.
+        vec3 planar_hitpt_vector = r.at(t) - Q;
+        auto alpha = dot(w, cross(planar_hitpt_vector, v));
+        auto beta = dot(w, cross(u, planar_hitpt_vector));
+        return interval(0, 1).contains(alpha) && interval(0, 1).contains(beta);
+    }
+
     virtual bool is_interior(double a, double b, hit_record& rec) const {
         interval unit_interval = interval(0, 1);
         // Given the hit point in plane coordinates, return false if it is outside the
@@ -66,9 +84,10 @@ class quad : public hittable {
     }
 
   private:
+    friend class compiled_scene;
     point3 Q;
     vec3 u, v, w;
-    shared_ptr<material> mat;
+    material_handle mat;
     aabb bbox;
     vec3 normal;
     double D;
@@ -2,11 +2,17 @@
 #define RT_H
 
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <limits>
 #include <memory>
 #include <random>
+#include <string>
+#include <type_traits>
+
+#include "rng.h"
 
 
 // C++ Std Usings
@@ -35,6 +41,9 @@ inline double random_double(std::mt19937& rng) {
     static thread_local std::uniform_real_distribution<double> dist(0.0, 1.0);
     return dist(rng);
 }
+inline double random_double(counter_rng& rng) {
+    return rng.next_double();
+}
 inline double random_double(double min, double max) {
     // Returns a random real in [min,max).
     return min + (max-min)*random_double();
@@ -43,6 +52,10 @@ inline double random_double(double min, double max, std::mt19937& rng) {
     std::uniform_real_distribution<double> dist(min, max);
     return dist(rng);
 }
+inline double random_double(double min, double max, counter_rng& rng) {
+    // Returns a random real in [min,max).
+    return min + (max-min)*rng.next_double();
+}
 
 inline int random_int(int min, int max) {
     return int(random_double((double)min, (double)(max+1)));
@@ -53,6 +66,35 @@ inline int random_int(int min, int max, std::mt19937& rng) {
     return int(random_double((double)min, (double)(max+1), rng));
 }
 
+class hasher {
+  public:
+    // Incremental 64-bit FNV-1a hash, used to fingerprint render settings and scenes.
+
+    void add_bytes(const void* data, size_t size) {
+        auto bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++) {
+            state ^= bytes[i];
+            state *= 0x100000001b3ull;
+        }
+    }
+
+    template <typename T>
+    void add(const T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "hasher::add needs plain data");
+        add_bytes(&value, sizeof(T));
+    }
+
+    void add(const std::string& text) {
+        add(text.size());
+        add_bytes(text.data(), text.size());
+    }
+
+    uint64_t value() const { return state; }
+
+  private:
+    uint64_t state = 0xcbf29ce484222325ull;
+};
+
 // Common Headers
 
 #include "colour.h"
@@ -0,0 +1,49 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+
+class counter_rng {
+  public:
+    // Counter-based generator: every draw is a hash of (key, counter), and the key is itself a
+    // hash of the render seed, the pixel and the sample index. A sample's random numbers
+    // therefore depend only on which sample it is, never on the thread, tile or process that
+    // computes it, and no state is shared between samples.
+
+    counter_rng(uint64_t seed, uint64_t pixel, uint64_t sample)
+      : key(mix(mix(mix(seed) ^ pixel) ^ sample)), counter(0) {}
+
+    void start_bounce(int depth) {
+        // Gives each bounce its own block of counters, so the numbers a bounce sees don't
+        // shift when an earlier bounce takes a different number of draws.
+        counter = uint64_t(depth + 1) << 20;
+    }
+
+    uint64_t next_u64() {
+        // SplitMix64 evaluated at an explicit counter.
+        return mix(key + (counter++) * 0x9e3779b97f4a7c15ull);
+    }
+
+    double next_double() {
+        // Returns a random real in [0,1).
+        return to_unit(next_u64());
+    }
+
+    static uint64_t mix(uint64_t z) {
+        // SplitMix64 finalizer: a bijective 64-bit hash with full avalanche.
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    static double to_unit(uint64_t bits) {
+        // Maps the top 53 bits to a real in [0,1).
+        return double(bits >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+  private:
+    uint64_t key;
+    uint64_t counter;
+};
+
+#endif
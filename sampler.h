@@ -0,0 +1,237 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "raytracing.h"
+
+#include <algorithm>
+
+enum class sampler_type {
+    independent,  // Uncorrelated uniform randoms from the counter-based stream
+    stratified,   // Jittered strata over the pixel's sample budget, shuffled per dimension
+    sobol,        // Owen-scrambled, index-shuffled 2D Sobol points padded across dimensions
+    blue_noise    // R2 sequence over samples with an R2 dither mask over pixels
+};
+
+class sampler {
+  public:
+    // Hands out the sample values one camera sample consumes, one dimension at a time. The
+    // camera takes the first dimensions (pixel jitter, lens, time) and every bounce starts a
+    // fresh block, so a given dimension always means the same decision whatever happened on
+    // earlier bounces. Points are a pure function of (seed, pixel, sample, dimension), which
+    // keeps renders independent of thread count.
+
+    sampler(sampler_type type, uint64_t seed, int x, int y, int sample_index, int samples_per_pixel)
+      : type(type), x(x), y(y), sample_index(uint32_t(sample_index)),
+        sample_count(std::max(1, samples_per_pixel)),
+        pixel_seed(counter_rng::mix(counter_rng::mix(seed) ^ (uint64_t(uint32_t(y)) << 32 | uint32_t(x)))),
+        rng(seed, uint64_t(uint32_t(y)) << 32 | uint32_t(x), uint64_t(sample_index)),
+        dimension(0)
+    {}
+
+    void start_bounce(int depth) {
+        dimension = camera_dimensions + depth * dimensions_per_bounce;
+        bounce_start = dimension;
+        rng.start_bounce(depth);
+    }
+
+    double free_flight() const {
+        // The bounce's last dimension, which scatter and roulette never reach. It is evaluated
+        // in place rather than drawn, so taking it moves no other sample value.
+        auto d = bounce_start + dimensions_per_bounce - 1;
+        switch (type) {
+            case sampler_type::stratified: return stratified_1d(d);
+            case sampler_type::sobol:      return sobol_2d(d).x();
+            case sampler_type::blue_noise: return r2_1d(d);
+            default:                       return to_unit(dimension_hash(d, 0x27d4eb2fu ^ sample_index));
+        }
+    }
+
+    double get_1d() {
+        auto d = dimension++;
+        switch (type) {
+            case sampler_type::stratified: return stratified_1d(d);
+            case sampler_type::sobol:      return sobol_2d(d).x();
+            case sampler_type::blue_noise: return r2_1d(d);
+            default:                       return rng.next_double();
+        }
+    }
+
+    vec3 get_2d() {
+        // Returns a point in [0,1)^2 in the x and y components.
+        auto d = dimension;
+        dimension += 2;
+        switch (type) {
+            case sampler_type::stratified: return stratified_2d(d);
+            case sampler_type::sobol:      return sobol_2d(d);
+            case sampler_type::blue_noise: return r2_2d(d);
+            default: {
+                auto u = rng.next_double();
+                return vec3(u, rng.next_double(), 0);
+            }
+        }
+    }
+
+    static const int camera_dimensions     = 5;  // Pixel jitter (2), lens (2), time (1)
+    static const int dimensions_per_bounce = 4;  // Material scatter (2), Russian roulette, free flight
+
+  private:
+    sampler_type type;
+    int x, y;
+    uint32_t sample_index;
+    int sample_count;
+    uint64_t pixel_seed;
+    counter_rng rng;
+    int dimension;
+    int bounce_start = camera_dimensions;
+
+    uint32_t dimension_hash(int d, uint32_t salt) const {
+        return uint32_t(counter_rng::mix(pixel_seed ^ (uint64_t(uint32_t(d)) << 32 | salt)));
+    }
+
+    static double to_unit(uint32_t bits) {
+        // Maps 32 bits to a real in [0,1).
+        return bits * (1.0 / 4294967296.0);
+    }
+
+    // Stratified
+
+    uint32_t permuted_index(int d, uint32_t n) const {
+        // Position of this sample in a per-pixel, per-dimension random permutation of [0,n),
+        // using Kensler's hash-based permutation so no table is needed. Samples past n (from
+        // adaptive top-ups) start a fresh permutation for each block of n.
+        uint32_t block = sample_index / n;
+        uint32_t i = sample_index % n;
+        uint32_t p = dimension_hash(d, block);
+
+        uint32_t w = n - 1;
+        w |= w >> 1; w |= w >> 2; w |= w >> 4; w |= w >> 8; w |= w >> 16;
+        do {
+            i ^= p;             i *= 0xe170893d;
+            i ^= p >> 16;       i ^= (i & w) >> 4;
+            i ^= p >> 8;        i *= 0x0929eb3f;
+            i ^= p >> 23;       i ^= (i & w) >> 1;
+            i *= 1 | p >> 27;   i *= 0x6935fa69;
+            i ^= (i & w) >> 11; i *= 0x74dcb303;
+            i ^= (i & w) >> 2;  i *= 0x9e501cc3;
+            i ^= (i & w) >> 2;  i *= 0xc860a3df;
+            i &= w;
+            i ^= i >> 5;
+        } while (i >= n);
+        return (i + p) % n;
+    }
+
+    double stratified_1d(int d) const {
+        auto n = uint32_t(sample_count);
+        auto stratum = permuted_index(d, n);
+        auto jitter = to_unit(dimension_hash(d, 0x9e3779b9u ^ sample_index));
+        return (stratum + jitter) / n;
+    }
+
+    vec3 stratified_2d(int d) const {
+        // Jittered grid over the largest square number of strata that fits the budget.
+        auto side = uint32_t(std::max(1.0, std::floor(std::sqrt(double(sample_count)))));
+        auto stratum = permuted_index(d, side * side);
+        auto jx = to_unit(dimension_hash(d, 0x85ebca6bu ^ sample_index));
+        auto jy = to_unit(dimension_hash(d + 1, 0xc2b2ae35u ^ sample_index));
+        return vec3((stratum % side + jx) / side, (stratum / side + jy) / side, 0);
+    }
+
+    // Sobol (Burley 2020, "Practical Hash-based Owen Scrambling")
+
+    static uint32_t reverse_bits(uint32_t v) {
+        v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+        v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+        v = ((v >> 4) & 0x0f0f0f0fu) | ((v & 0x0f0f0f0fu) << 4);
+        v = ((v >> 8) & 0x00ff00ffu) | ((v & 0x00ff00ffu) << 8);
+        return (v >> 16) | (v << 16);
+    }
+
+    static uint32_t nested_uniform_scramble(uint32_t v, uint32_t seed) {
+        // Owen scrambling as a hash: Laine-Karras permutation on the bit-reversed value.
+        v = reverse_bits(v);
+        v += seed;
+        v ^= v * 0x6c50b47cu;
+        v ^= v * 0xb82f1e52u;
+        v ^= v * 0xc7afe638u;
+        v ^= v * 0x8d22f6e6u;
+        return reverse_bits(v);
+    }
+
+    static uint32_t sobol_dimension_1(uint32_t index) {
+        // Second Sobol dimension; its direction numbers are v_k = v_(k-1) ^ (v_(k-1) >> 1).
+        uint32_t result = 0;
+        for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+            if (index & 1)
+                result ^= v;
+        return result;
+    }
+
+    vec3 sobol_2d(int d) const {
+        // Each dimension pair gets its own shuffle of the sample index and its own scrambling,
+        // which decorrelates the pairs while keeping the 2D stratification within each.
+        uint32_t index = nested_uniform_scramble(sample_index, dimension_hash(d, 0));
+        uint32_t sx = nested_uniform_scramble(reverse_bits(index), dimension_hash(d, 1));
+        uint32_t sy = nested_uniform_scramble(sobol_dimension_1(index), dimension_hash(d, 2));
+        return vec3(to_unit(sx), to_unit(sy), 0);
+    }
+
+    // R2 (Roberts 2018): low-discrepancy over samples, blue-noise-like dither over pixels
+
+    static double fract(double v) { return v - std::floor(v); }
+
+    double pixel_dither(int d) const {
+        // The R2 sequence evaluated at the pixel position has blue-noise-like spectral
+        // properties; a per-dimension offset keeps the dimensions from sharing one mask.
+        const double a1 = 0.7548776662466927, a2 = 0.5698402909980532;
+        return fract(x * a1 + y * a2 + to_unit(dimension_hash(d, 3)));
+    }
+
+    double r2_1d(int d) const {
+        const double golden = 0.6180339887498949;
+        return fract(pixel_dither(d) + sample_index * golden);
+    }
+
+    vec3 r2_2d(int d) const {
+        const double a1 = 0.7548776662466927, a2 = 0.5698402909980532;
+        auto offset = pixel_dither(d);
+        return vec3(fract(offset + sample_index * a1),
+                    fract(offset + to_unit(dimension_hash(d, 4)) + sample_index * a2), 0);
+    }
+};
+
+// Closed-form warps from [0,1)^2, replacing rejection sampling.
+
+inline vec3 sample_concentric_disk(const vec3& u) {
+    // Shirley-Chiu concentric mapping from the unit square to the unit disk.
+    auto ox = 2*u.x() - 1;
+    auto oy = 2*u.y() - 1;
+    if (ox == 0 && oy == 0)
+        return vec3(0,0,0);
+
+    double r, theta;
+    if (std::fabs(ox) > std::fabs(oy)) {
+        r = ox;
+        theta = (pi/4) * (oy / ox);
+    } else {
+        r = oy;
+        theta = (pi/2) - (pi/4) * (ox / oy);
+    }
+    return vec3(r * std::cos(theta), r * std::sin(theta), 0);
+}
+
+inline vec3 sample_cosine_hemisphere(const vec3& u) {
+    // Cosine-weighted direction about +z (Malley's method).
+    auto d = sample_concentric_disk(u);
+    auto z = std::sqrt(std::fmax(0.0, 1 - d.x()*d.x() - d.y()*d.y()));
+    return vec3(d.x(), d.y(), z);
+}
+
+inline vec3 sample_uniform_sphere(const vec3& u) {
+    // Uniformly distributed unit vector.
+    auto z = 1 - 2*u.x();
+    auto r = std::sqrt(std::fmax(0.0, 1 - z*z));
+    auto phi = 2*pi*u.y();
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+#endif
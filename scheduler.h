@@ -0,0 +1,205 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct tile {
+    int x0, y0;  // Upper-left pixel (inclusive)
+    int x1, y1;  // Lower-right pixel (exclusive)
+    int index;   // Row-major position of the tile in the image
+};
+
+template <typename T>
+class work_stealing_deque {
+  public:
+    void push(const T& item) {
+        std::lock_guard<std::mutex> lock(mtx);
+        items.push_back(item);
+    }
+
+    bool pop(T& item) {
+        // The owning worker takes work from the front, in the order it was dealt.
+        std::lock_guard<std::mutex> lock(mtx);
+        if (items.empty())
+            return false;
+        item = items.front();
+        items.pop_front();
+        return true;
+    }
+
+    bool steal(T& item) {
+        // Thieves take from the back, the work furthest from what the owner is doing.
+        std::lock_guard<std::mutex> lock(mtx);
+        if (items.empty())
+            return false;
+        item = items.back();
+        items.pop_back();
+        return true;
+    }
+
+  private:
+    std::mutex mtx;
+    std::deque<T> items;
+};
+
+inline int resolve_worker_count(int requested) {
+    // A requested count of zero or less means "use every hardware thread".
+    if (requested > 0)
+        return requested;
+    int count = int(std::thread::hardware_concurrency());
+    return count > 0 ? count : 4;
+}
+
+class tile_scheduler {
+  public:
+    tile_scheduler(int width, int height, int tile_size) {
+        tile_size = std::max(1, tile_size);
+        for (int y = 0; y < height; y += tile_size) {
+            for (int x = 0; x < width; x += tile_size) {
+                int index = int(tile_list.size());
+                tile_list.push_back({x, y, std::min(x + tile_size, width), std::min(y + tile_size, height), index});
+            }
+        }
+    }
+
+    explicit tile_scheduler(std::vector<tile> tiles) : tile_list(std::move(tiles)) {}
+
+    const std::vector<tile>& tiles() const { return tile_list; }
+
+    template <typename Func>
+    void run(int worker_count, Func&& render_tile) const {
+        // Calls render_tile(tile, worker_id) once for every tile. Each worker is dealt a
+        // contiguous run of tiles up front; a worker that runs dry steals from the others, so
+        // the render finishes when the total work is done rather than the slowest band.
+        if (tile_list.empty())
+            return;
+        worker_count = std::max(1, std::min(resolve_worker_count(worker_count), int(tile_list.size())));
+
+        std::vector<work_stealing_deque<int>> queues(worker_count);
+        size_t per_worker = (tile_list.size() + worker_count - 1) / worker_count;
+        for (size_t t = 0; t < tile_list.size(); ++t)
+            queues[t / per_worker].push(int(t));
+
+        auto worker = [&](int worker_id) {
+            int t;
+            while (true) {
+                bool found = queues[worker_id].pop(t);
+                for (int k = 1; !found && k < worker_count; ++k)
+                    found = queues[(worker_id + k) % worker_count].steal(t);
+
+                // Tiles are only dealt before the workers start, so empty queues everywhere
+                // means there is nothing left to do.
+                if (!found)
+                    return;
+
+                render_tile(tile_list[t], worker_id);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (int w = 1; w < worker_count; ++w)
+            threads.emplace_back(worker, w);
+        worker(0);
+        for (auto& th : threads) th.join();
+    }
+
+  private:
+    std::vector<tile> tile_list;
+};
+
+class task_pool {
+  public:
+    // Runs tasks, which may spawn further tasks, on a fixed set of threads. The thread that
+    // created the pool counts as one of them: it runs queued tasks whenever it waits on a
+    // group, as does any task waiting on its own subtasks, so nested waits cannot deadlock.
+
+    class group {
+      public:
+        group() : pending(0) {}
+
+      private:
+        friend class task_pool;
+        std::atomic<int> pending;
+    };
+
+    explicit task_pool(int worker_count) {
+        worker_count = resolve_worker_count(worker_count);
+        for (int w = 1; w < worker_count; ++w) {
+            threads.emplace_back([this] {
+                while (true) {
+                    std::function<void()> task;
+                    group* owner;
+                    {
+                        std::unique_lock<std::mutex> lock(mtx);
+                        wake.wait(lock, [this] { return stopping || !tasks.empty(); });
+                        if (tasks.empty())
+                            return;
+                        owner = tasks.front().first;
+                        task = std::move(tasks.front().second);
+                        tasks.pop_front();
+                    }
+                    task();
+                    owner->pending--;
+                }
+            });
+        }
+    }
+
+    ~task_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& th : threads) th.join();
+    }
+
+    void spawn(group& g, std::function<void()> task) {
+        g.pending++;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            tasks.emplace_back(&g, std::move(task));
+        }
+        wake.notify_one();
+    }
+
+    void wait(group& g) {
+        while (g.pending > 0) {
+            if (!run_one())
+                std::this_thread::yield();
+        }
+    }
+
+  private:
+    std::mutex mtx;
+    std::condition_variable wake;
+    std::deque<std::pair<group*, std::function<void()>>> tasks;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+
+    bool run_one() {
+        std::function<void()> task;
+        group* owner;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (tasks.empty())
+                return false;
+            // Take the newest task: it is the likeliest to be one this thread just spawned.
+            owner = tasks.back().first;
+            task = std::move(tasks.back().second);
+            tasks.pop_back();
+        }
+        task();
+        owner->pending--;
+        return true;
+    }
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "raytracing.h"
 #include "hittable.h"
+#include "material.h"
 
 class sphere : public hittable {
   public:
@@ -17,7 +18,7 @@ class sphere : public hittable {
     // Moving Sphere
     sphere(const point3& center1, const point3& center2, double radius,
            shared_ptr<material> mat)
-      : center(center1, center2 - center1), radius(std::fmax(0,radius)), mat(mat) 
+      : center(center1, center2 - center1), radius(std::fmax(0,radius)), mat(mat)
       {
         auto rvec = vec3(radius, radius, radius);
         aabb box1(center.at(0) - rvec, center.at(0) + rvec);
@@ -25,6 +26,19 @@ class sphere : public hittable {
         bbox = aabb(box1, box2);
       }
 
+    void move_to(const point3& new_center) {
+        // Moves the sphere between frames; the BVH holding it needs an update() afterwards.
+        move_to(new_center, new_center);
+    }
+
+    void move_to(const point3& center1, const point3& center2) {
+        center = ray(center1, center2 - center1);
+        auto rvec = vec3(radius, radius, radius);
+        aabb box1(center.at(0) - rvec, center.at(0) + rvec);
+        aabb box2(center.at(1) - rvec, center.at(1) + rvec);
+        bbox = aabb(box1, box2);
+    }
+
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {        
         point3 current_center = center.at(r.time());
         vec3 oc = current_center - r.origin();
@@ -51,11 +65,26 @@ class sphere : public hittable {
         vec3 outward_normal = (rec.p - current_center) / radius;        
         rec.set_face_normal(r, outward_normal);
         get_sphere_uv(outward_normal, rec.u, rec.v);
-        rec.mat = mat;
+        rec.mat = mat.id();
 
         return true;
     }
 
+    bool occluded(const ray& r, interval ray_t) const override {
+        // The same quadratic as hit(), but either root inside ray_t will do.
+        vec3 oc = center.at(r.time()) - r.origin();
+        auto a = r.direction().length_squared();
+        auto h = dot(r.direction(), oc);
+        auto c = oc.length_squared() - radius*radius;
+
+        auto discriminant = h*h - a*c;
+        if (discriminant < 0)
+            return false;
+
+        auto sqrtd = std::sqrt(discriminant);
+        return ray_t.surrounds((h - sqrtd) / a) || ray_t.surrounds((h + sqrtd) / a);
+    }
+
     static void get_sphere_uv(const point3& p, double& u, double& v) {
         auto theta = std::acos(-p.y());
         auto phi = std::atan2(-p.z(), p.x()) + pi;
@@ -67,9 +96,10 @@ class sphere : public hittable {
     aabb bounding_box() const override { return bbox; }
 
   private:
+    friend class compiled_scene;
     ray center;
     double radius;
-    shared_ptr<material> mat;
+    material_handle mat;
     aabb bbox;
 };
 
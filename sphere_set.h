@@ -0,0 +1,369 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include "bvh.h"
+#include "shapes.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+class sphere_set : public hittable {
+  public:
+    // Many small spheres as one hittable, with no per-sphere heap objects. The set builds its
+    // own BVH with leaves of up to eight spheres, and stores each leaf as a block of float
+    // arrays (centres, motion vectors, radii) so that one SIMD sequence tests the whole leaf.
+    //
+    // The SIMD test only rules spheres out. It measures the ray's distance from each centre
+    // against a radius padded by the worst float rounding, so it never rejects a sphere the
+    // ray hits; the few that pass are intersected in double exactly as sphere::hit does, and
+    // only the nearest gets a normal, UV and material. Images match a list of sphere objects.
+    //
+    // Add the spheres, then call build() before rendering. Calling it again (after adding more
+    // spheres, or with other options) rebuilds from the spheres as they were added.
+
+    void add(const point3& center, double radius, shared_ptr<material> mat) {
+        add(center, center, radius, mat);
+    }
+
+    void add(const point3& center1, const point3& center2, double radius, shared_ptr<material> mat) {
+        // A sphere moving from center1 at time 0 to center2 at time 1.
+        material_handle handle(mat);
+        auto id = handle.id();
+        materials.try_emplace(id, std::move(handle));
+        spheres.push_back({center1, center2 - center1, std::fmax(0, radius), id});
+    }
+
+    void build(bvh_build_options options = bvh_build_options()) {
+        // Leaves are tested a block at a time, so a sphere in a leaf costs the SAH much less
+        // than it would as a separate object; only candidates pay for a full test.
+        options.max_leaf_size = lanes;
+        options.intersection_cost = options.traversal_cost / 2;
+
+        std::vector<bvh_primitive> prims(spheres.size());
+        for (size_t i = 0; i < spheres.size(); i++) {
+            auto box = bounds(spheres[i]);
+            prims[i] = {box, box.centroid(), i};
+        }
+        linear_bvh tree(std::move(prims), options);
+        nodes = std::move(tree.nodes);
+        bbox = tree.bounds;
+
+        // Give every leaf its own blocks, and point the leaf at its first block rather than at
+        // a run of primitive_order. Unused lanes repeat the leaf's last sphere.
+        std::vector<sphere_record> ordered;
+        blocks.clear();
+        for (auto& node : nodes) {
+            if (node.count == 0)
+                continue;
+            auto first_block = uint32_t(blocks.size());
+            for (int start = 0; start < node.count; start += lanes) {
+                sphere_block block;
+                for (int k = 0; k < lanes; k++) {
+                    auto slot = node.offset + std::min(start + k, node.count - 1);
+                    const auto& s = spheres[tree.primitive_order[slot]];
+                    block.center_x[k] = float(s.center[0]);
+                    block.center_y[k] = float(s.center[1]);
+                    block.center_z[k] = float(s.center[2]);
+                    block.motion_x[k] = float(s.motion[0]);
+                    block.motion_y[k] = float(s.motion[1]);
+                    block.motion_z[k] = float(s.motion[2]);
+                    block.radius[k] = padded_radius(s);
+                    ordered.push_back(s);
+                }
+                blocks.push_back(block);
+            }
+            node.offset = first_block;
+        }
+
+        // Lane k of block b is records[lanes*b + k].
+        records = std::move(ordered);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (nodes.empty())
+            return false;
+
+        set_ray sr(r);
+        vec3 inv_dir(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+        bool dir_is_neg[3] = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
+
+        const sphere_record* closest = nullptr;
+        uint32_t stack[linear_bvh::max_depth];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while (stack_size > 0) {
+            auto current = stack[--stack_size];
+            const auto& node = nodes[current];
+            trace_stats::node_visit(1);
+            if (!linear_bvh::node_hit(node, r.origin(), inv_dir, ray_t))
+                continue;
+
+            if (node.count == 0) {
+                // Push the farther child first, so the nearer one is visited next.
+                bool right_first = dir_is_neg[node.axis];
+                stack[stack_size++] = right_first ? current + 1 : node.offset;
+                stack[stack_size++] = right_first ? node.offset : current + 1;
+                continue;
+            }
+
+            trace_stats::primitive_tests(node.count);
+            for (int start = 0; start < node.count; start += lanes) {
+                auto block = node.offset + start / lanes;
+                int mask = candidates(blocks[block], sr, ray_t) & lane_mask(node.count - start);
+                for (; mask != 0; mask &= mask - 1) {
+                    const auto& s = records[lanes * block + lowest_bit(mask)];
+                    double t;
+                    if (nearest_root(s, r, ray_t, t)) {
+                        ray_t.max = t;
+                        closest = &s;
+                    }
+                }
+            }
+        }
+
+        if (closest == nullptr)
+            return false;
+
+        auto center = closest->center + r.time() * closest->motion;
+        rec.t = ray_t.max;
+        rec.p = r.at(rec.t);
+        vec3 outward_normal = (rec.p - center) / closest->radius;
+        rec.set_face_normal(r, outward_normal);
+        sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+        rec.mat = closest->material;
+        return true;
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override {
+        if (nodes.empty())
+            return false;
+
+        set_ray sr(r);
+        vec3 inv_dir(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+
+        uint32_t stack[linear_bvh::max_depth];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while (stack_size > 0) {
+            auto current = stack[--stack_size];
+            const auto& node = nodes[current];
+            trace_stats::node_visit(1);
+            if (!linear_bvh::node_hit(node, r.origin(), inv_dir, ray_t))
+                continue;
+
+            if (node.count == 0) {
+                stack[stack_size++] = node.offset;
+                stack[stack_size++] = current + 1;
+                continue;
+            }
+
+            trace_stats::primitive_tests(node.count);
+            for (int start = 0; start < node.count; start += lanes) {
+                auto block = node.offset + start / lanes;
+                int mask = candidates(blocks[block], sr, ray_t) & lane_mask(node.count - start);
+                for (; mask != 0; mask &= mask - 1) {
+                    if (any_root(records[lanes * block + lowest_bit(mask)], r, ray_t))
+                        return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+  private:
+    static constexpr int lanes = 8;  // Spheres per leaf block
+
+    struct alignas(32) sphere_block {
+        float center_x[lanes], center_y[lanes], center_z[lanes];  // Centre at time 0
+        float motion_x[lanes], motion_y[lanes], motion_z[lanes];  // Centre movement by time 1
+        float radius[lanes];  // Padded by the block's rounding error; see padded_radius()
+    };
+
+    struct sphere_record {
+        point3      center;  // Centre at time 0
+        vec3        motion;  // Centre movement by time 1
+        double      radius;
+        material_id material;
+    };
+
+    struct set_ray {
+        // The ray in float, with what the block test needs precomputed.
+        float origin[3];
+        float dir[3];
+        float time;
+        float length;   // |dir|
+        float a;        // |dir|^2
+        float padding;  // Float rounding allowance for the origin's magnitude
+
+        set_ray(const ray& r) {
+            for (int axis = 0; axis < 3; axis++) {
+                origin[axis] = float(r.origin()[axis]);
+                dir[axis] = float(r.direction()[axis]);
+            }
+            time = float(r.time());
+            a = dir[0]*dir[0] + dir[1]*dir[1] + dir[2]*dir[2];
+            length = std::sqrt(a);
+            padding = rounding_allowance(r.origin().length());
+        }
+    };
+
+    std::vector<sphere_record> spheres;  // As added
+    std::vector<sphere_record> records;  // Block by block, as build() laid them out
+    std::unordered_map<material_id, material_handle> materials;  // One handle per material used
+    std::vector<sphere_block> blocks;
+    std::vector<linear_bvh_node> nodes;
+    aabb bbox;
+
+    static float rounding_allowance(double magnitude) {
+        // Far more than float rounding can move a coordinate or distance of this magnitude
+        // through the few operations in the block test (about 170 ulps).
+        return float(1e-5 * (magnitude + 1));
+    }
+
+    static float padded_radius(const sphere_record& s) {
+        auto magnitude = s.center.length() + s.motion.length() + s.radius;
+        return float(s.radius * (1 + 1e-5) + rounding_allowance(magnitude));
+    }
+
+    static aabb bounds(const sphere_record& s) {
+        auto rvec = vec3(s.radius, s.radius, s.radius);
+        aabb box1(s.center - rvec, s.center + rvec);
+        aabb box2(s.center + s.motion - rvec, s.center + s.motion + rvec);
+        return aabb(box1, box2);
+    }
+
+    static int lane_mask(int count) { return count >= lanes ? (1 << lanes) - 1 : (1 << count) - 1; }
+
+    static int lowest_bit(int mask) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, unsigned(mask));
+        return int(index);
+#else
+        return __builtin_ctz(unsigned(mask));
+#endif
+    }
+
+    static bool nearest_root(const sphere_record& s, const ray& r, const interval& ray_t, double& t) {
+        // As sphere::hit, up to choosing the root.
+        vec3 oc = s.center + r.time() * s.motion - r.origin();
+        auto a = r.direction().length_squared();
+        auto h = dot(r.direction(), oc);
+        auto c = oc.length_squared() - s.radius*s.radius;
+
+        auto discriminant = h*h - a*c;
+        if (discriminant < 0)
+            return false;
+
+        auto sqrtd = std::sqrt(discriminant);
+        t = (h - sqrtd) / a;
+        if (!ray_t.surrounds(t)) {
+            t = (h + sqrtd) / a;
+            if (!ray_t.surrounds(t))
+                return false;
+        }
+        return true;
+    }
+
+    static bool any_root(const sphere_record& s, const ray& r, const interval& ray_t) {
+        double t;
+        return nearest_root(s, r, ray_t, t);
+    }
+
+    // The block test: a lane passes if the ray's line comes within the padded radius of the
+    // centre, |oc x d|^2 <= r^2 |d|^2, and the padded sphere overlaps [t_min, t_max] along the
+    // ray, h - r|d| <= t_max |d|^2 and h + r|d| >= t_min |d|^2. The cross product form avoids
+    // the cancellation in the usual discriminant, so the padding can stay small.
+
+    static int candidates(const sphere_block& b, const set_ray& r, const interval& ray_t) {
+#if defined(__AVX__)
+        return candidates_avx(b, r, ray_t);
+#elif defined(__SSE2__) || defined(_M_X64)
+        return candidates_sse(b, r, ray_t, 0) | (candidates_sse(b, r, ray_t, 4) << 4);
+#else
+        return candidates_scalar(b, r, ray_t);
+#endif
+    }
+
+    static int candidates_scalar(const sphere_block& b, const set_ray& r, const interval& ray_t) {
+        float t_min = float(ray_t.min), t_max = float(ray_t.max);
+        int mask = 0;
+        for (int k = 0; k < lanes; k++) {
+            float ox = b.center_x[k] + r.time * b.motion_x[k] - r.origin[0];
+            float oy = b.center_y[k] + r.time * b.motion_y[k] - r.origin[1];
+            float oz = b.center_z[k] + r.time * b.motion_z[k] - r.origin[2];
+            float cx = oy * r.dir[2] - oz * r.dir[1];
+            float cy = oz * r.dir[0] - ox * r.dir[2];
+            float cz = ox * r.dir[1] - oy * r.dir[0];
+            float radius = b.radius[k] + r.padding;
+            float h = ox * r.dir[0] + oy * r.dir[1] + oz * r.dir[2];
+            float reach = radius * r.length;
+            if (cx*cx + cy*cy + cz*cz <= radius * radius * r.a
+                && h - reach <= t_max * r.a && h + reach >= t_min * r.a)
+                mask |= 1 << k;
+        }
+        return mask;
+    }
+
+#if defined(__SSE2__) || defined(_M_X64)
+    static int candidates_sse(const sphere_block& b, const set_ray& r, const interval& ray_t, int first) {
+        // Lanes [first, first+4) of the block.
+        __m128 time = _mm_set1_ps(r.time);
+        __m128 ox = _mm_sub_ps(_mm_add_ps(_mm_load_ps(b.center_x + first), _mm_mul_ps(time, _mm_load_ps(b.motion_x + first))), _mm_set1_ps(r.origin[0]));
+        __m128 oy = _mm_sub_ps(_mm_add_ps(_mm_load_ps(b.center_y + first), _mm_mul_ps(time, _mm_load_ps(b.motion_y + first))), _mm_set1_ps(r.origin[1]));
+        __m128 oz = _mm_sub_ps(_mm_add_ps(_mm_load_ps(b.center_z + first), _mm_mul_ps(time, _mm_load_ps(b.motion_z + first))), _mm_set1_ps(r.origin[2]));
+        __m128 dx = _mm_set1_ps(r.dir[0]), dy = _mm_set1_ps(r.dir[1]), dz = _mm_set1_ps(r.dir[2]);
+
+        __m128 cx = _mm_sub_ps(_mm_mul_ps(oy, dz), _mm_mul_ps(oz, dy));
+        __m128 cy = _mm_sub_ps(_mm_mul_ps(oz, dx), _mm_mul_ps(ox, dz));
+        __m128 cz = _mm_sub_ps(_mm_mul_ps(ox, dy), _mm_mul_ps(oy, dx));
+        __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, cx), _mm_mul_ps(cy, cy)), _mm_mul_ps(cz, cz));
+
+        __m128 a = _mm_set1_ps(r.a);
+        __m128 radius = _mm_add_ps(_mm_load_ps(b.radius + first), _mm_set1_ps(r.padding));
+        __m128 h = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, dx), _mm_mul_ps(oy, dy)), _mm_mul_ps(oz, dz));
+        __m128 reach = _mm_mul_ps(radius, _mm_set1_ps(r.length));
+
+        __m128 near_line = _mm_cmple_ps(distance, _mm_mul_ps(_mm_mul_ps(radius, radius), a));
+        __m128 before_max = _mm_cmple_ps(_mm_sub_ps(h, reach), _mm_mul_ps(_mm_set1_ps(float(ray_t.max)), a));
+        __m128 after_min = _mm_cmpge_ps(_mm_add_ps(h, reach), _mm_mul_ps(_mm_set1_ps(float(ray_t.min)), a));
+        return _mm_movemask_ps(_mm_and_ps(near_line, _mm_and_ps(before_max, after_min)));
+    }
+#endif
+
+#if defined(__AVX__)
+    static int candidates_avx(const sphere_block& b, const set_ray& r, const interval& ray_t) {
+        __m256 time = _mm256_set1_ps(r.time);
+        __m256 ox = _mm256_sub_ps(_mm256_add_ps(_mm256_load_ps(b.center_x), _mm256_mul_ps(time, _mm256_load_ps(b.motion_x))), _mm256_set1_ps(r.origin[0]));
+        __m256 oy = _mm256_sub_ps(_mm256_add_ps(_mm256_load_ps(b.center_y), _mm256_mul_ps(time, _mm256_load_ps(b.motion_y))), _mm256_set1_ps(r.origin[1]));
+        __m256 oz = _mm256_sub_ps(_mm256_add_ps(_mm256_load_ps(b.center_z), _mm256_mul_ps(time, _mm256_load_ps(b.motion_z))), _mm256_set1_ps(r.origin[2]));
+        __m256 dx = _mm256_set1_ps(r.dir[0]), dy = _mm256_set1_ps(r.dir[1]), dz = _mm256_set1_ps(r.dir[2]);
+
+        __m256 cx = _mm256_sub_ps(_mm256_mul_ps(oy, dz), _mm256_mul_ps(oz, dy));
+        __m256 cy = _mm256_sub_ps(_mm256_mul_ps(oz, dx), _mm256_mul_ps(ox, dz));
+        __m256 cz = _mm256_sub_ps(_mm256_mul_ps(ox, dy), _mm256_mul_ps(oy, dx));
+        __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(cx, cx), _mm256_mul_ps(cy, cy)), _mm256_mul_ps(cz, cz));
+
+        __m256 a = _mm256_set1_ps(r.a);
+        __m256 radius = _mm256_add_ps(_mm256_load_ps(b.radius), _mm256_set1_ps(r.padding));
+        __m256 h = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ox, dx), _mm256_mul_ps(oy, dy)), _mm256_mul_ps(oz, dz));
+        __m256 reach = _mm256_mul_ps(radius, _mm256_set1_ps(r.length));
+
+        __m256 near_line = _mm256_cmp_ps(distance, _mm256_mul_ps(_mm256_mul_ps(radius, radius), a), _CMP_LE_OQ);
+        __m256 before_max = _mm256_cmp_ps(_mm256_sub_ps(h, reach), _mm256_mul_ps(_mm256_set1_ps(float(ray_t.max)), a), _CMP_LE_OQ);
+        __m256 after_min = _mm256_cmp_ps(_mm256_add_ps(h, reach), _mm256_mul_ps(_mm256_set1_ps(float(ray_t.min)), a), _CMP_GE_OQ);
+        return _mm256_movemask_ps(_mm256_and_ps(near_line, _mm256_and_ps(before_max, after_min)));
+    }
+#endif
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <cstdint>
+
+struct trace_counters {
+    uint64_t camera_rays     = 0;  // Paths started from the camera
+    uint64_t bounces         = 0;  // Scattering events along those paths
+    uint64_t node_visits     = 0;  // BVH nodes a ray entered
+    uint64_t box_tests       = 0;  // Ray-box slab tests, one per child of a wide node
+    uint64_t primitive_tests = 0;  // Primitive hit calls made from BVH leaves and lists
+
+    uint64_t cost() const {
+        // Work done, as the SAH cost model counts it.
+        return box_tests + primitive_tests;
+    }
+
+    trace_counters& operator+=(const trace_counters& c) {
+        camera_rays += c.camera_rays;
+        bounces += c.bounces;
+        node_visits += c.node_visits;
+        box_tests += c.box_tests;
+        primitive_tests += c.primitive_tests;
+        return *this;
+    }
+
+    trace_counters operator-(const trace_counters& c) const {
+        trace_counters d;
+        d.camera_rays = camera_rays - c.camera_rays;
+        d.bounces = bounces - c.bounces;
+        d.node_visits = node_visits - c.node_visits;
+        d.box_tests = box_tests - c.box_tests;
+        d.primitive_tests = primitive_tests - c.primitive_tests;
+        return d;
+    }
+};
+
+class trace_stats {
+  public:
+    // Traversal instrumentation, compiled in only when RT_STATS is defined; otherwise every
+    // call below is empty. Each thread counts into its own counters with plain increments, and
+    // whoever wants the work done by some unit of rendering takes the difference of local()
+    // before and after it on the same thread.
+
+#ifdef RT_STATS
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+
+    static trace_counters& local() {
+        thread_local trace_counters counters;
+        return counters;
+    }
+
+    static void camera_ray() { if constexpr (enabled) local().camera_rays++; }
+    static void bounce() { if constexpr (enabled) local().bounces++; }
+    static void node_visit(int box_tests) {
+        if constexpr (enabled) {
+            local().node_visits++;
+            local().box_tests += box_tests;
+        }
+    }
+    static void primitive_tests(uint64_t n) { if constexpr (enabled) local().primitive_tests += n; }
+};
+
+#endif
@@ -0,0 +1,51 @@
+// Builds BVHs over inputs that split badly and checks that no path is deeper than the
+// traversal stacks hold and that every primitive lands in exactly one leaf slot.
+
+#include "raytracing.h"
+#include "bvh.h"
+
+static std::vector<bvh_primitive> make_prims(const std::vector<point3>& centres) {
+    std::vector<bvh_primitive> prims(centres.size());
+    for (size_t i = 0; i < centres.size(); i++) {
+        aabb box(centres[i] - vec3(0.5, 0.5, 0.5), centres[i] + vec3(0.5, 0.5, 0.5));
+        prims[i] = {box, box.centroid(), i};
+    }
+    return prims;
+}
+
+static bool check(const char* name, const std::vector<point3>& centres, bvh_split split) {
+    bvh_build_options options;
+    options.split = split;
+    linear_bvh tree(make_prims(centres), options);
+
+    bool ok = linear_bvh::valid_nodes(tree.nodes.data(), tree.nodes.size(), tree.primitive_order.size());
+    if (split != bvh_split::sbvh) {
+        std::vector<int> seen(centres.size(), 0);
+        for (auto index : tree.primitive_order)
+            seen[index]++;
+        for (auto n : seen)
+            ok = ok && n == 1;
+    }
+
+    std::cout << (ok ? "ok   " : "FAIL ") << name << "\n";
+    return ok;
+}
+
+int main() {
+    // Every centroid in one place: no plane separates any of them.
+    std::vector<point3> identical(200000, point3(1, 2, 3));
+
+    // More primitives than a leaf holds in one place, with a chain of outliers each sixteen
+    // times as far as the last, so the SAH peels off an outlier per level and the cluster is
+    // still too big for one leaf at max_depth.
+    std::vector<point3> chain(70000, point3(0, 0, 0));
+    for (int k = 1; k <= 200; k++)
+        chain.push_back(point3(std::ldexp(1.0, 4 * k), 0, 0));
+
+    bool ok = true;
+    for (auto split : {bvh_split::sah, bvh_split::median, bvh_split::lbvh, bvh_split::sbvh}) {
+        ok = check("identical centroids", identical, split) && ok;
+        ok = check("outlier chain", chain, split) && ok;
+    }
+    return ok ? 0 : 1;
+}
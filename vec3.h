@@ -111,40 +111,6 @@ inline vec3 unit_vector(const vec3& v) {
     return v / v.length();
 }
 
-inline vec3 random_in_unit_disk(std::mt19937& rng) {
-    while (true) {
-        auto p = vec3(random_double(-1,1, rng), random_double(-1,1, rng), 0);
-        if (p.length_squared() < 1)
-            return p;
-    }
-}
-
-inline vec3 random_unit_vector() {
-    while (true) {
-        auto p = vec3::random(-1,1);
-        auto lensq = p.length_squared();
-        if (1e-160 < lensq && lensq <= 1)
-            return p / sqrt(lensq);
-    }
-}
-
-inline vec3 random_unit_vector(std::mt19937& rng) {
-    while (true) {
-        auto p = vec3::random(-1,1, rng);
-        auto lensq = p.length_squared();
-        if (1e-160 < lensq && lensq <= 1)
-            return p / sqrt(lensq);
-    }
-}
-
-inline vec3 random_on_hemisphere(const vec3& normal, std::mt19937& rng) {
-    vec3 on_unit_sphere = random_unit_vector(rng);
-    if (dot(on_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
-        return on_unit_sphere;
-    else
-        return -on_unit_sphere;
-}
-
 inline vec3 reflect(const vec3& v, const vec3& n) {
     return v - 2*dot(v,n)*n;
 }
@@ -0,0 +1,415 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "bvh.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+template <int W>
+struct alignas(32) wide_bvh_node {
+    // Bounds of all W children in structure-of-arrays form, so each slab plane of every child
+    // loads as one vector. Unused slots have empty (inverted) bounds and are never hit.
+    float    min_x[W], min_y[W], min_z[W];
+    float    max_x[W], max_y[W], max_z[W];
+    uint32_t child[W];  // Leaf: first primitive. Interior: index of the child node.
+    uint16_t count[W];  // Primitives in a leaf child; 0 for an interior or unused child
+};
+
+template <int W>
+class wide_bvh : public hittable {
+  public:
+    // A W-ary BVH made by collapsing the binary SAH tree: each wide node pulls up the
+    // grandchildren of its largest interior children until it holds W children. A ray tests
+    // all children of a node with one set of SIMD slab tests, then visits the ones it hit
+    // nearest first.
+
+    static_assert(W == 4 || W == 8, "wide_bvh supports 4 or 8 children per node");
+
+    wide_bvh(hittable_list list, const bvh_build_options& options = bvh_build_options())
+      : wide_bvh(list.objects, options) {}
+
+    wide_bvh(const std::vector<shared_ptr<hittable>>& objects, const bvh_build_options& options)
+      : source_objects(objects), options(options) {
+        build(source_objects, true);
+    }
+
+    bool update() {
+        // As bvh_node::update: refits the wide nodes to the primitives' current bounds between
+        // frames, or rebuilds once the refitted tree has grown too costly. Returns true if it
+        // rebuilt.
+        bbox = aabb::empty;
+        for (size_t i = nodes.size(); i-- > 0;)
+            refit(nodes[i]);
+        if (sah_cost() <= options.rebuild_cost_ratio * build_cost)
+            return false;
+
+        build(source_objects, false);
+        return true;
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (nodes.empty())
+            return false;
+
+        ray_data rd;
+        for (int a = 0; a < 3; a++) {
+            rd.origin[a] = float(r.origin()[a]);
+            rd.inv_dir[a] = float(1.0 / r.direction()[a]);
+            rd.dir_is_neg[a] = rd.inv_dir[a] < 0;
+        }
+
+        // Stack entries are either wide nodes (count 0) or leaf primitive ranges.
+        struct entry { uint32_t index; uint32_t count; float t; };
+        entry stack[linear_bvh::max_depth * W];
+        int stack_size = 0;
+        stack[stack_size++] = {0, 0, float(ray_t.min)};
+
+        bool hit_anything = false;
+        while (stack_size > 0) {
+            auto top = stack[--stack_size];
+            if (top.t > ray_t.max)
+                continue;
+
+            if (top.count > 0) {
+                trace_stats::primitive_tests(top.count);
+                for (uint32_t i = top.index; i < top.index + top.count; i++) {
+                    if (primitives[i]->hit(r, ray_t, rec)) {
+                        hit_anything = true;
+                        ray_t.max = rec.t;
+                    }
+                }
+                continue;
+            }
+
+            const auto& node = nodes[top.index];
+            trace_stats::node_visit(W);
+            float t_near[W];
+            int mask = intersect_children(node, rd, float(ray_t.min), float(ray_t.max), t_near);
+
+            // Push the children hit farthest first, so the nearest is popped next.
+            entry pending[W];
+            int pending_count = 0;
+            for (int k = 0; k < W; k++) {
+                if (!(mask & (1 << k)))
+                    continue;
+                int slot = pending_count++;
+                while (slot > 0 && pending[slot - 1].t < t_near[k]) {
+                    pending[slot] = pending[slot - 1];
+                    slot--;
+                }
+                pending[slot] = {node.child[k], node.count[k], t_near[k]};
+            }
+            for (int k = 0; k < pending_count; k++)
+                stack[stack_size++] = pending[k];
+        }
+
+        return hit_anything;
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override {
+        // As hit(), but stops at the first blocking primitive. With ray_t fixed there is
+        // nothing to gain from sorting the children, so they are pushed as the mask gives them.
+        if (nodes.empty())
+            return false;
+
+        ray_data rd;
+        for (int a = 0; a < 3; a++) {
+            rd.origin[a] = float(r.origin()[a]);
+            rd.inv_dir[a] = float(1.0 / r.direction()[a]);
+            rd.dir_is_neg[a] = rd.inv_dir[a] < 0;
+        }
+
+        uint32_t stack[linear_bvh::max_depth * W];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while (stack_size > 0) {
+            const auto& node = nodes[stack[--stack_size]];
+            trace_stats::node_visit(W);
+            float t_near[W];
+            int mask = intersect_children(node, rd, float(ray_t.min), float(ray_t.max), t_near);
+
+            for (int k = 0; k < W; k++) {
+                if (!(mask & (1 << k)))
+                    continue;
+                if (node.count[k] == 0) {
+                    stack[stack_size++] = node.child[k];
+                    continue;
+                }
+                trace_stats::primitive_tests(node.count[k]);
+                for (uint32_t i = node.child[k]; i < node.child[k] + node.count[k]; i++) {
+                    if (primitives[i]->occluded(r, ray_t))
+                        return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+  private:
+    struct ray_data {
+        float origin[3];
+        float inv_dir[3];
+        bool  dir_is_neg[3];
+    };
+
+    std::vector<wide_bvh_node<W>> nodes;
+    std::vector<shared_ptr<hittable>> primitives;
+    std::vector<shared_ptr<hittable>> source_objects;  // As given; SBVH leaves repeat some in primitives
+    aabb bbox;
+    bvh_build_options options;
+    double build_cost = 0;  // SAH cost when last built, for update()'s rebuild test
+
+    void build(const std::vector<shared_ptr<hittable>>& objects, bool use_cache) {
+        // The cache holds the binary tree, which is collapsed afresh: collapsing is one linear
+        // pass, far cheaper than the SAH build it replaces.
+        auto prims = bvh_primitives(objects);
+        use_cache = use_cache && !options.cache_path.empty();
+        auto key = use_cache ? mapped_bvh::scene_key(prims, options) : 0;
+        auto cache = use_cache ? mapped_bvh::load(options.cache_path, key, objects.size()) : nullptr;
+
+        primitives.clear();
+        nodes.clear();
+        if (cache) {
+            bbox = cache->bounds;
+            primitives.reserve(cache->primitive_count);
+            for (size_t slot = 0; slot < cache->primitive_count; slot++)
+                primitives.push_back(objects[cache->primitive_order[slot]]);
+            if (cache->node_count > 0)
+                collapse(cache->nodes, 0);
+        } else {
+            linear_bvh tree(std::move(prims), options);
+            if (use_cache && !mapped_bvh::save(options.cache_path, key, tree))
+                std::clog << "Failed to write BVH cache " << options.cache_path << ".\n";
+
+            bbox = tree.bounds;
+            primitives.reserve(tree.primitive_order.size());
+            for (auto index : tree.primitive_order)
+                primitives.push_back(objects[index]);
+            if (!tree.nodes.empty())
+                collapse(tree.nodes.data(), 0);
+        }
+        build_cost = sah_cost();
+    }
+
+    // Child slots are leaves when their count is nonzero, unused when their child index is
+    // also 0 (the root is never anyone's child), and interior otherwise.
+
+    void refit(wide_bvh_node<W>& node) {
+        // Children follow their parent in `nodes`, so refitting in reverse order sees every
+        // interior child's slots already up to date.
+        for (int k = 0; k < W; k++) {
+            aabb box = aabb::empty;
+            if (node.count[k] > 0) {
+                for (uint32_t i = node.child[k]; i < node.child[k] + node.count[k]; i++)
+                    box = aabb(box, primitives[i]->bounding_box());
+                bbox = aabb(bbox, box);
+            } else if (node.child[k] != 0) {
+                const auto& child = nodes[node.child[k]];
+                for (int c = 0; c < W; c++) {
+                    if (child.count[c] == 0 && child.child[c] == 0)
+                        continue;
+                    box = aabb(box, aabb(point3(child.min_x[c], child.min_y[c], child.min_z[c]),
+                                         point3(child.max_x[c], child.max_y[c], child.max_z[c])));
+                }
+            } else {
+                continue;
+            }
+
+            auto fitted = linear_bvh::make_node(box);
+            node.min_x[k] = fitted.bounds_min[0];
+            node.min_y[k] = fitted.bounds_min[1];
+            node.min_z[k] = fitted.bounds_min[2];
+            node.max_x[k] = fitted.bounds_max[0];
+            node.max_y[k] = fitted.bounds_max[1];
+            node.max_z[k] = fitted.bounds_max[2];
+        }
+    }
+
+    double sah_cost() const {
+        // linear_bvh::sah_cost for the wide tree: every child slot a ray enters costs a
+        // traversal step if it is interior, or its primitive tests if it is a leaf.
+        auto root_area = bbox.surface_area();
+        if (nodes.empty() || root_area <= 0)
+            return 0;
+
+        double cost = options.traversal_cost;
+        for (const auto& node : nodes) {
+            for (int k = 0; k < W; k++) {
+                if (node.count[k] == 0 && node.child[k] == 0)
+                    continue;
+                double dx = node.max_x[k] - node.min_x[k];
+                double dy = node.max_y[k] - node.min_y[k];
+                double dz = node.max_z[k] - node.min_z[k];
+                auto area = 2 * (dx * dy + dy * dz + dz * dx);
+                cost += area / root_area * (node.count[k] > 0 ? options.intersection_cost * node.count[k]
+                                                               : options.traversal_cost);
+            }
+        }
+        return cost;
+    }
+
+    uint32_t collapse(const linear_bvh_node* binary, uint32_t root) {
+        // Emits the wide node standing for binary node `root` and returns its index.
+        std::vector<uint32_t> children;
+        if (binary[root].count > 0) {
+            children.push_back(root);
+        } else {
+            children = {root + 1, binary[root].offset};
+            while (int(children.size()) < W) {
+                // Open the interior child with the largest surface area.
+                int best = -1;
+                double best_area = -1;
+                for (int k = 0; k < int(children.size()); k++) {
+                    const auto& n = binary[children[k]];
+                    if (n.count > 0)
+                        continue;
+                    auto area = linear_bvh::surface_area(n);
+                    if (area > best_area) {
+                        best_area = area;
+                        best = k;
+                    }
+                }
+                if (best < 0)
+                    break;
+                auto opened = children[best];
+                children[best] = opened + 1;
+                children.push_back(binary[opened].offset);
+            }
+        }
+
+        auto index = uint32_t(nodes.size());
+        nodes.emplace_back();
+        auto& node = nodes.back();
+        for (int k = 0; k < W; k++) {
+            node.min_x[k] = node.min_y[k] = node.min_z[k] = std::numeric_limits<float>::infinity();
+            node.max_x[k] = node.max_y[k] = node.max_z[k] = -std::numeric_limits<float>::infinity();
+            node.child[k] = 0;
+            node.count[k] = 0;
+        }
+
+        for (int k = 0; k < int(children.size()); k++) {
+            const auto& n = binary[children[k]];
+            nodes[index].min_x[k] = n.bounds_min[0];
+            nodes[index].min_y[k] = n.bounds_min[1];
+            nodes[index].min_z[k] = n.bounds_min[2];
+            nodes[index].max_x[k] = n.bounds_max[0];
+            nodes[index].max_y[k] = n.bounds_max[1];
+            nodes[index].max_z[k] = n.bounds_max[2];
+            if (n.count > 0) {
+                nodes[index].child[k] = n.offset;
+                nodes[index].count[k] = n.count;
+            } else {
+                // Recursing may reallocate `nodes`, so the slot is written by index afterwards.
+                auto child = collapse(binary, children[k]);
+                nodes[index].child[k] = child;
+            }
+        }
+        return index;
+    }
+
+    // Slab tests return a bit mask of the children hit within [t_min, t_max] and each child's
+    // entry distance. The near and far planes are picked per axis from the direction's sign.
+    // Far distances are pushed out slightly so float rounding never culls a box the ray
+    // actually grazes. A NaN distance, from a ray in a slab's plane, leaves the running bound
+    // alone.
+
+    static int intersect_children(
+        const wide_bvh_node<W>& node, const ray_data& rd, float t_min, float t_max, float* t_near
+    ) {
+#if defined(__AVX__)
+        if constexpr (W == 8)
+            return intersect_avx(node, rd, t_min, t_max, t_near);
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+        if constexpr (W == 4)
+            return intersect_sse(node, rd, t_min, t_max, t_near);
+#endif
+        return intersect_scalar(node, rd, t_min, t_max, t_near);
+    }
+
+    static constexpr float far_scale = 1 + 2 * 3 * std::numeric_limits<float>::epsilon();
+
+    static int intersect_scalar(
+        const wide_bvh_node<W>& node, const ray_data& rd, float t_min, float t_max, float* t_near
+    ) {
+        const float* lo[3] = {node.min_x, node.min_y, node.min_z};
+        const float* hi[3] = {node.max_x, node.max_y, node.max_z};
+
+        int mask = 0;
+        for (int k = 0; k < W; k++) {
+            float t0 = t_min, t1 = t_max;
+            for (int a = 0; a < 3; a++) {
+                const float* near_plane = rd.dir_is_neg[a] ? hi[a] : lo[a];
+                const float* far_plane = rd.dir_is_neg[a] ? lo[a] : hi[a];
+                float tn = (near_plane[k] - rd.origin[a]) * rd.inv_dir[a];
+                float tf = (far_plane[k] - rd.origin[a]) * rd.inv_dir[a] * far_scale;
+                t0 = tn > t0 ? tn : t0;
+                t1 = tf < t1 ? tf : t1;
+            }
+            t_near[k] = t0;
+            if (t0 <= t1)
+                mask |= 1 << k;
+        }
+        return mask;
+    }
+
+#if defined(__SSE2__) || defined(_M_X64)
+    static int intersect_sse(
+        const wide_bvh_node<W>& node, const ray_data& rd, float t_min, float t_max, float* t_near
+    ) {
+        const float* lo[3] = {node.min_x, node.min_y, node.min_z};
+        const float* hi[3] = {node.max_x, node.max_y, node.max_z};
+
+        __m128 t0 = _mm_set1_ps(t_min);
+        __m128 t1 = _mm_set1_ps(t_max);
+        for (int a = 0; a < 3; a++) {
+            __m128 origin = _mm_set1_ps(rd.origin[a]);
+            __m128 inv_dir = _mm_set1_ps(rd.inv_dir[a]);
+            __m128 near_plane = _mm_load_ps(rd.dir_is_neg[a] ? hi[a] : lo[a]);
+            __m128 far_plane = _mm_load_ps(rd.dir_is_neg[a] ? lo[a] : hi[a]);
+            __m128 tn = _mm_mul_ps(_mm_sub_ps(near_plane, origin), inv_dir);
+            __m128 tf = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(far_plane, origin), inv_dir), _mm_set1_ps(far_scale));
+            t0 = _mm_max_ps(tn, t0);
+            t1 = _mm_min_ps(tf, t1);
+        }
+        _mm_storeu_ps(t_near, t0);
+        return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+    }
+#endif
+
+#if defined(__AVX__)
+    static int intersect_avx(
+        const wide_bvh_node<W>& node, const ray_data& rd, float t_min, float t_max, float* t_near
+    ) {
+        const float* lo[3] = {node.min_x, node.min_y, node.min_z};
+        const float* hi[3] = {node.max_x, node.max_y, node.max_z};
+
+        __m256 t0 = _mm256_set1_ps(t_min);
+        __m256 t1 = _mm256_set1_ps(t_max);
+        for (int a = 0; a < 3; a++) {
+            __m256 origin = _mm256_set1_ps(rd.origin[a]);
+            __m256 inv_dir = _mm256_set1_ps(rd.inv_dir[a]);
+            __m256 near_plane = _mm256_load_ps(rd.dir_is_neg[a] ? hi[a] : lo[a]);
+            __m256 far_plane = _mm256_load_ps(rd.dir_is_neg[a] ? lo[a] : hi[a]);
+            __m256 tn = _mm256_mul_ps(_mm256_sub_ps(near_plane, origin), inv_dir);
+            __m256 tf = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(far_plane, origin), inv_dir),
+                                      _mm256_set1_ps(far_scale));
+            t0 = _mm256_max_ps(tn, t0);
+            t1 = _mm256_min_ps(tf, t1);
+        }
+        _mm256_storeu_ps(t_near, t0);
+        return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+    }
+#endif
+};
+
+using bvh4 = wide_bvh<4>;
+using bvh8 = wide_bvh<8>;
+
+#endif